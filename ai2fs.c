@@ -1,3 +1,7 @@
+#ifdef __linux__
+  // pipe2() and accept4(), so a descriptor is close-on-exec from the start
+  #define _GNU_SOURCE
+#endif
 /*
  * ai2fs - AI output to filesystem parser
  * Version: 1.0.0
@@ -33,7 +37,24 @@
  * - Handles both Unix and Windows-style paths
  * - No external dependencies
  * 
- * Usage: ai2fs <input_file>
+ * This file is the command-line tool; the parser itself is libai2fs.c,
+ * whose interface is in ai2fs.h.
+ * 
+ * Usage: ai2fs [-q] [-j N] [-p N] [--no-mmap] [--no-uring] [--atomic]
+ *              [--incremental] [--first-wins] [--output=tar:FILE] [--stats[=json]]
+ *              [--max-mem=SIZE] [--max-file-size=SIZE]
+ *              [--markers=FILE] [--marker=TEXT]...
+ *              [--include=GLOB]... [--exclude=GLOB]... <input_file | ->
+ *        ai2fs --batch [-q] [-j N] [--no-mmap] [--atomic] [--incremental]
+ *              [--first-wins] [--output=tar:FILE] [--stats[=json]]
+ *              [--max-mem=SIZE] [--max-file-size=SIZE]
+ *              [--markers=FILE] [--marker=TEXT]...
+ *              [--include=GLOB]... [--exclude=GLOB]... <input_file | @manifest>...
+ *        ai2fs --dry-run [--manifest=json] [--include=GLOB]... [--exclude=GLOB]...
+ *              <input_file>
+ *        ai2fs --watch [-q] [--atomic] [--first-wins] [--max-file-size=SIZE] <input_file>
+ *        ai2fs --serve=SOCKET [-q] [-j N] [--atomic] [--incremental] [--first-wins]
+ *              [--max-mem=SIZE] [--max-file-size=SIZE] [--workspaces=DIR]
  * 
  * Output Structure:
  * generated-code/
@@ -52,33 +73,5281 @@
  * License: MIT
  */
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <ctype.h>
-#include <sys/stat.h>
-#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+
+#ifdef _WIN32
+  #include <windows.h>
+  #include <direct.h>
+  #include <io.h>
+  #include <fcntl.h>
+  #include <process.h>
+#else
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <pthread.h>
+  #include <sys/wait.h>
+  #include <sys/socket.h>
+  #include <sys/un.h>
+  #include <poll.h>
+  #include <sys/time.h>
+#endif
+#ifdef __linux__
+  #include <sys/inotify.h>
+#endif
+#include <time.h>
+#include <stdint.h>
+
+#include "ai2fs.h"
+
+/* io_uring output on Linux; build with -DAI2FS_NO_URING to leave it out */
+#if defined(__linux__) && !defined(AI2FS_NO_URING) && defined(__has_include)
+  #if __has_include(<linux/io_uring.h>)
+    #include <sys/syscall.h>
+    #include <linux/io_uring.h>
+    #ifdef IORING_FEAT_LINKED_FILE
+      #define AI2FS_URING 1
+    #endif
+  #endif
+#endif
+
+/* Overlapped output on Windows; build with -DAI2FS_NO_OVERLAPPED to leave it out */
+#if defined(_WIN32) && !defined(AI2FS_NO_OVERLAPPED)
+  #define AI2FS_OVERLAPPED 1
+#endif
+
+/* libFuzzer build (-DAI2FS_FUZZ): the bench build, with main() left to libFuzzer */
+#ifdef AI2FS_FUZZ
+  #ifndef AI2FS_BENCH
+    #define AI2FS_BENCH 1
+  #endif
+  #define main ai2fs_main
+#endif
+
+/* Sub-second part of a file's mtime, where struct stat has one */
+#if defined(__APPLE__)
+  #define STAT_MTIME_NSEC(st) ((long)(st)->st_mtimespec.tv_nsec)
+#elif defined(_WIN32)
+  #define STAT_MTIME_NSEC(st) 0L
+#else
+  #define STAT_MTIME_NSEC(st) ((long)(st)->st_mtim.tv_nsec)
+#endif
+
+/* Constants */
+#define PROGRAM_NAME "ai2fs"
+#define ROOT_FOLDER "generated-code"
+#define MAX_PATH_LENGTH AI2FS_MAX_PATH
+#define TEMP_PATH_LENGTH (MAX_PATH_LENGTH + 64)
+#define READ_CHUNK_SIZE (1 << 20)
+#define STREAM_BUFFER_SIZE (64 << 10)
+#define COMPARE_CHUNK_SIZE (64 << 10)
+#define PARSE_CHUNK_MIN (1 << 20)
+#define MAX_WRITERS 64
+#define WRITE_QUEUE_DEPTH 64
+#define WRITE_QUEUE_BYTES (64u << 20)
+#define WRITE_QUEUE_SPINS 256
+#define LOG_BUFFER_SIZE (64 << 10)
+#define ARENA_BLOCK_SIZE (64 << 10)
+#define URING_BATCH 64
+#define URING_FILE_SQES 5
+#define URING_MAX_WRITE (1u << 30)
+#define PREALLOCATE_MIN (1 << 20)
+#define OVERLAPPED_BATCH 64
+#define OVERLAPPED_MAX_WRITE (1u << 30)
+#define SERVE_QUEUE_DEPTH 64
+#define CONTENT_DIGEST_SIZE 32
+#define SERVE_IDLE_TIMEOUT 30
+#define WATCH_POLL_MS 250
+#define TAR_BLOCK_SIZE 512
+#define TAR_BUFFER_SIZE (1 << 20)
+#define TAR_MAX_OCTAL 077777777777ULL
+
+/* Global variables */
+static ai2fs_markers *MARKERS;
+#ifdef AI2FS_BENCH
+  static long BENCH_WRITE_DELAY_US;
+#endif
+
+/* Minimal thread layer over Win32 and pthreads for the writer pool */
+#ifdef _WIN32
+  typedef HANDLE thread_handle;
+  typedef CRITICAL_SECTION mutex_handle;
+  typedef CONDITION_VARIABLE cond_handle;
+  #define THREAD_RETURN DWORD WINAPI
+  #define mutex_init(m) InitializeCriticalSection(m)
+  #define mutex_destroy(m) DeleteCriticalSection(m)
+  #define mutex_lock(m) EnterCriticalSection(m)
+  #define mutex_unlock(m) LeaveCriticalSection(m)
+  #define cond_init(c) InitializeConditionVariable(c)
+  #define cond_destroy(c) ((void)(c))
+  #define cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+  #define cond_signal(c) WakeConditionVariable(c)
+  #define cond_broadcast(c) WakeAllConditionVariable(c)
+  #define thread_start(t, fn, arg) ((*(t) = CreateThread(NULL, 0, fn, arg, 0, NULL)) ? 0 : -1)
+  #define thread_join(t) (WaitForSingleObject(t, INFINITE), CloseHandle(t))
+  #define ring_load(p) ((unsigned long long)InterlockedCompareExchange64((volatile LONG64 *)(p), 0, 0))
+  #define ring_store(p, v) ((void)InterlockedExchange64((volatile LONG64 *)(p), (LONG64)(v)))
+  #define ring_add(p, n) ((void)InterlockedExchangeAdd64((volatile LONG64 *)(p), (LONG64)(n)))
+#else
+  typedef pthread_t thread_handle;
+  typedef pthread_mutex_t mutex_handle;
+  typedef pthread_cond_t cond_handle;
+  #define THREAD_RETURN void *
+  #define mutex_init(m) pthread_mutex_init(m, NULL)
+  #define mutex_destroy(m) pthread_mutex_destroy(m)
+  #define mutex_lock(m) pthread_mutex_lock(m)
+  #define mutex_unlock(m) pthread_mutex_unlock(m)
+  #define cond_init(c) pthread_cond_init(c, NULL)
+  #define cond_destroy(c) pthread_cond_destroy(c)
+  #define cond_wait(c, m) pthread_cond_wait(c, m)
+  #define cond_signal(c) pthread_cond_signal(c)
+  #define cond_broadcast(c) pthread_cond_broadcast(c)
+  #define thread_start(t, fn, arg) pthread_create(t, NULL, fn, arg)
+  #define thread_join(t) pthread_join(t, NULL)
+  #define ring_load(p) __atomic_load_n(p, __ATOMIC_SEQ_CST)
+  #define ring_store(p, v) __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+  #define ring_add(p, n) ((void)__atomic_fetch_add(p, n, __ATOMIC_SEQ_CST))
+#endif
+
+/* Bump allocator in ARENA_BLOCK_SIZE blocks; everything is freed at once */
+struct arena_block {
+  struct arena_block *next;
+  size_t used;
+  size_t size;
+  char data[];
+};
+
+struct arena {
+  struct arena_block *head;
+};
+
+/*
+ * Set of directories created during this run, so each one costs a single
+ * mkdir. Open addressing over FNV-1a hashes; grows at half load. Names are
+ * kept in an arena. After dir_cache_share() create_directories() serializes
+ * on its lock.
+ */
+struct dir_cache {
+  char **entries;
+  size_t *hashes;
+  size_t count;
+  size_t capacity;
+  struct arena names;
+  int shared;
+  mutex_handle lock;
+};
+
+/*
+ * What --serve last wrote to each path of a root, so --incremental can
+ * trust a file whose size, inode and mtime are as it left them, and whose
+ * content has the same SHA-256, instead of reading it back. Open addressing like dir_cache; only the thread holding
+ * the root's lock touches it.
+ */
+struct content_entry {
+  const char *path;
+  size_t path_hash;
+  size_t size;
+  unsigned char digest[CONTENT_DIGEST_SIZE];
+  unsigned long long inode;
+  long long mtime;
+  long mtime_nsec;
+};
+
+struct content_index {
+  struct content_entry *entries;
+  size_t count;
+  size_t capacity;
+  struct arena paths;
+};
+
+/* Wall and CPU time of one phase of a run */
+struct phase_time {
+  const char *name;
+  double wall;
+  double cpu;
+};
+
+#define MAX_PHASES 4
+
+/*
+ * Process-wide counters for --stats and the benchmark. Call times are
+ * summed over all threads and only taken when timing is set, so a plain
+ * run pays for a few relaxed atomic adds per file. Build with
+ * -DAI2FS_NO_STATS to compile all of it out.
+ */
+struct run_stats {
+  unsigned long long bytes_read;
+  unsigned long long bytes_written;
+  unsigned long long lines;
+  unsigned long long marker_lines[AI2FS_MAX_MARKERS];
+  unsigned long long mkdirs;
+  unsigned long long opens;
+  unsigned long long stats;
+  unsigned long long writes;
+  unsigned long long peak_buffer;
+  unsigned long long filtered;
+  unsigned long long repeated;
+  unsigned long long writer_stalls;
+  unsigned long long mkdir_ns;
+  unsigned long long open_ns;
+  unsigned long long write_ns;
+  unsigned long long log_ns;
+  struct phase_time phases[MAX_PHASES];
+  int phase_count;
+  int timing;
+};
+
+static struct run_stats STATS;
+
+#ifdef AI2FS_NO_STATS
+  #define stat_add(counter, n) ((void)0)
+  #define stat_max(counter, n) ((void)0)
+  #define stat_clock() 0.0
+  #define stat_time(counter, start) ((void)(start))
+#else
+  #ifdef _WIN32
+    #define stat_add(counter, n) \
+      InterlockedExchangeAdd64((volatile LONG64 *)&(counter), (LONG64)(n))
+  #else
+    #define stat_add(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+  #endif
+  #define stat_max(counter, n) stats_raise(&(counter), (n))
+  #define stat_clock() (STATS.timing ? monotonic_seconds() : 0.0)
+  #define stat_time(counter, start) \
+    do { \
+      if (STATS.timing) { \
+        stat_add(counter, (unsigned long long)((monotonic_seconds() - (start)) * 1e9)); \
+      } \
+    } while (0)
+#endif
+
+/* Per-run totals of what happened to each output file */
+struct write_totals {
+  size_t created;
+  size_t updated;
+  size_t unchanged;
+  size_t failed;
+  mutex_handle lock;
+};
+
+/* Outcome of writing one file */
+enum write_status {
+  WRITE_FAILED,
+  WRITE_CREATED,
+  WRITE_UPDATED,
+  WRITE_UNCHANGED
+};
+
+/*
+ * Progress messages bound for stdout, or for a --serve client when fd is
+ * set. They are copied into one buffer under a lock and written out when
+ * it fills, so a run costs one write per LOG_BUFFER_SIZE of messages
+ * instead of a stdio call per file.
+ */
+struct progress_log {
+  char buffer[LOG_BUFFER_SIZE];
+  size_t length;
+  int fd;
+  mutex_handle lock;
+};
+
+struct uring;
+struct overlapped_batch;
+
+/* An archive being written by --output=tar:FILE; entries are appended under lock */
+struct tar_sink {
+  int fd;
+  const char *archive;
+  char target[TEMP_PATH_LENGTH];
+  int atomic;
+  char *buffer;
+  size_t length;
+  unsigned long long mtime;
+  int failed;
+  #ifdef _WIN32
+    HANDLE process;
+  #else
+    pid_t child;
+    void (*saved_sigpipe)(int);
+  #endif
+  mutex_handle lock;
+};
+
+/* One step of a compiled glob */
+enum glob_op {
+  GLOB_LITERAL,
+  GLOB_ONE,
+  GLOB_STAR,
+  GLOB_DEEP,
+  GLOB_DIRS
+};
+
+struct glob_step {
+  enum glob_op op;
+  const char *text;
+  size_t len;
+};
+
+/*
+ * A --include or --exclude pattern compiled into steps: literal runs, "?"
+ * (one character but '/'), "*" (any run without '/'), "**" (any run) and
+ * "**" followed by '/' (nothing, or any run of whole directories). A
+ * pattern without '/' is matched against the file name only; a trailing
+ * '/' stands for everything below that directory.
+ */
+struct glob {
+  struct glob_step *steps;
+  size_t count;
+  int name_only;
+};
+
+/* A path is kept if it matches an include (or there are none) and no exclude */
+struct path_filter {
+  struct glob *includes;
+  size_t include_count;
+  struct glob *excludes;
+  size_t exclude_count;
+};
+
+/*
+ * Where a transcript's files go and how existing files are treated. With
+ * incremental set, a file whose content is already on disk is left alone;
+ * quiet drops the per-file messages, which otherwise go to log (or straight
+ * to stdout when it is NULL). With atomic set each file is written under a
+ * temporary name and renamed into place. A ring or an overlapped batch, if
+ * any, takes the writes of the thread that owns it; a tar sink replaces the
+ * directory tree. Files rejected by filter are dropped before anything is
+ * written. When a path repeats, its last block is written, or its first
+ * with first_wins. index is only set by --serve with --incremental. A file
+ * over max_file_size bytes (if set) is reported as failed and not written.
+ */
+struct output {
+  const char *root;
+  struct dir_cache *dirs;
+  int incremental;
+  struct write_totals *totals;
+  int quiet;
+  struct progress_log *log;
+  int atomic;
+  struct uring *ring;
+  struct tar_sink *tar;
+  const struct path_filter *filter;
+  int first_wins;
+  struct content_index *index;
+  struct overlapped_batch *batch;
+  unsigned long long max_file_size;
+};
+
+/* One parsed file: its output, path and the slice of the input holding its content */
+struct write_job {
+  const struct output *out;
+  char path[MAX_PATH_LENGTH];
+  const char *data;
+  size_t size;
+};
+
+/*
+ * Single-producer, single-consumer ring feeding one writer thread. The
+ * parsing thread advances tail and the writer advances head, without a
+ * lock; bytes counts the content queued or being written, which is held
+ * under WRITE_QUEUE_BYTES unless the writer is idle. A side with nothing
+ * to do spins WRITE_QUEUE_SPINS times, then raises its waiting flag and
+ * sleeps; the other side takes the lock only to wake a raised flag.
+ */
+struct write_queue {
+  struct write_job jobs[WRITE_QUEUE_DEPTH];
+  unsigned long long head;
+  unsigned long long tail;
+  unsigned long long bytes;
+  unsigned long long closed;
+  unsigned long long writer_waiting;
+  unsigned long long submitter_waiting;
+  mutex_handle lock;
+  cond_handle not_empty;
+  cond_handle not_full;
+};
+
+/*
+ * Writer threads for -j N. Jobs are sharded by a hash of their path, so all
+ * writes to one path go through the same FIFO and the last block in input
+ * order wins, exactly as in a sequential run. Ordered jobs, whose paths
+ * meet another file's directory, all share the first FIFO. Jobs are submitted from one
+ * thread only.
+ */
+struct writer_pool {
+  struct write_queue *queues;
+  thread_handle *threads;
+  int size;
+};
+
+/*
+ * Input buffer: the whole transcript, either mapped or read into memory.
+ * Zero-initialize it once; the read buffer is kept and reused by later
+ * load_input() calls until release_input(). With limit set (--max-mem) the
+ * read buffer stops growing there: an input that does not fit is left
+ * with the text read so far and rest open on the remainder, for
+ * process_rest(). With stream set, a compressed input is never unpacked
+ * into the buffer: rest is the decompressor's output from its first byte.
+ */
+struct input_buffer {
+  char *data;
+  size_t size;
+  int mapped;
+  char *buffer;
+  size_t capacity;
+  size_t limit;
+  int stream;
+  FILE *rest;
+  const char *tool;
+  #ifdef _WIN32
+    HANDLE process;
+  #else
+    pid_t child;
+    pid_t feeder;
+  #endif
+};
+
+/* Command-line options */
+struct options {
+  char **inputs;
+  size_t input_count;
+  int batch;
+  int use_mmap;
+  int jobs;
+  int parse_jobs;
+  int incremental;
+  int stats;
+  int quiet;
+  int atomic;
+  int use_uring;
+  const char *archive;
+  int manifest;
+  int first_wins;
+  const char *serve;
+  const char *workspaces;
+  int watch;
+  const char **includes;
+  size_t include_count;
+  const char **excludes;
+  size_t exclude_count;
+  const char *marker_file;
+  const char *extra_markers[AI2FS_MAX_MARKERS];
+  size_t extra_marker_count;
+  size_t max_mem;
+  unsigned long long max_file_size;
+};
+
+/* --stats report formats */
+enum stats_format {
+  STATS_OFF,
+  STATS_TEXT,
+  STATS_JSON
+};
+
+/* --dry-run manifest formats */
+enum manifest_format {
+  MANIFEST_OFF,
+  MANIFEST_TEXT,
+  MANIFEST_JSON
+};
+
+/* Function declarations */
+void *arena_alloc(struct arena *arena, size_t size);
+int path_filter_init(struct path_filter *filter, const struct options *opts);
+int path_selected(const struct path_filter *filter, const char *path);
+void path_filter_free(struct path_filter *filter);
+void arena_free(struct arena *arena);
+int dir_cache_contains(const struct dir_cache *cache, const char *dir, size_t len);
+int dir_cache_insert(struct dir_cache *cache, const char *dir, size_t len);
+void dir_cache_share(struct dir_cache *cache);
+void free_dir_cache(struct dir_cache *cache);
+void create_directories(struct dir_cache *cache, const char *root, const char *path);
+int content_index_matches(const struct content_index *index, const char *path,
+    const char *full_path, size_t size, const unsigned char *digest);
+void content_index_record(struct content_index *index, const char *path, const char *full_path,
+    size_t size, const unsigned char *digest);
+void free_content_index(struct content_index *index);
+int file_has_content(const char *full_path, const char *data, size_t size);
+void log_init(struct progress_log *log);
+void log_message(struct progress_log *log, const char *prefix, const char *text,
+    const char *suffix);
+void log_flush(struct progress_log *log);
+void log_destroy(struct progress_log *log);
+enum write_status write_file_block(const struct output *out, const char *path,
+    const char *data, size_t size);
+int writer_pool_start(struct writer_pool *pool, int size, struct dir_cache *dirs);
+void writer_pool_submit(struct writer_pool *pool, const struct output *out, const char *path,
+    const char *data, size_t size, int ordered);
+void writer_pool_finish(struct writer_pool *pool);
+int tar_open(struct tar_sink *tar, const char *archive, int atomic);
+void tar_add(struct tar_sink *tar, const struct output *out, const char *path,
+    const char *data, size_t size);
+int tar_close(struct tar_sink *tar);
+#ifdef AI2FS_URING
+struct uring *uring_start(void);
+int uring_write_file(struct uring *ring, const struct output *out, const char *path,
+    const char *data, size_t size);
+void uring_finish(struct uring *ring);
+#endif
+#ifdef AI2FS_OVERLAPPED
+struct overlapped_batch *overlapped_start(void);
+int overlapped_write_file(struct overlapped_batch *batch, const struct output *out, const char *path,
+    const char *data, size_t size);
+void overlapped_finish(struct overlapped_batch *batch);
+#endif
+int process_stream(const struct output *out);
+int process_watch(const char *filename, const struct output *out);
+int load_input(const char *filename, int use_mmap, struct input_buffer *input);
+const char *input_decompressor(const char *data, size_t size);
+int decompress_input(const char *filename, const char *tool, struct input_buffer *input);
+int process_rest(const char *filename, struct input_buffer *input, const struct output *out);
+void release_input(struct input_buffer *input);
+void process_input(const struct input_buffer *input, const struct output *out,
+    struct writer_pool *pool);
+void process_input_parallel(const struct input_buffer *input, const struct output *out,
+    struct writer_pool *pool, int threads);
+int run_batch(const struct options *opts, const struct output *base);
+#ifndef _WIN32
+int run_serve(const char *socket_path, const char *workspaces, int threads, size_t max_mem,
+    const struct output *base);
+#endif
+double monotonic_seconds(void);
+double cpu_seconds(void);
+void stats_raise(unsigned long long *counter, unsigned long long value);
+void stats_phase(const char *name, double *wall_start, double *cpu_start);
+void print_stats(enum stats_format format, const struct write_totals *totals);
+int write_manifest(const struct input_buffer *input, const char *filename,
+    enum manifest_format format, const struct path_filter *filter);
+#ifdef AI2FS_BENCH
+int generate_main(int argc, char *argv[]);
+int bench_main(int argc, char *argv[]);
+int fuzz_main(int argc, char *argv[]);
+int classify_main(int argc, char *argv[]);
+#endif
+
+/* Function implementations */
+static size_t hash_bytes(const char *data, size_t len) {
+  size_t hash = (size_t)14695981039346656037ULL;
+  size_t i;
+  
+  for (i = 0; i < len; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= (size_t)1099511628211ULL;
+  }
+  return hash;
+}
+
+#define SHA256_ROTATE(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/* One 64-byte block of SHA-256 folded into state */
+static void sha256_block(uint32_t state[8], const unsigned char *block) {
+  static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+  };
+  uint32_t w[64];
+  uint32_t v[8];
+  int i;
+  
+  for (i = 0; i < 16; i++) {
+    w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+        (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+  }
+  for (i = 16; i < 64; i++) {
+    uint32_t s0 = SHA256_ROTATE(w[i - 15], 7) ^ SHA256_ROTATE(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = SHA256_ROTATE(w[i - 2], 17) ^ SHA256_ROTATE(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  memcpy(v, state, sizeof(v));
+  for (i = 0; i < 64; i++) {
+    uint32_t s1 = SHA256_ROTATE(v[4], 6) ^ SHA256_ROTATE(v[4], 11) ^ SHA256_ROTATE(v[4], 25);
+    uint32_t t1 = v[7] + s1 + ((v[4] & v[5]) ^ (~v[4] & v[6])) + k[i] + w[i];
+    uint32_t s0 = SHA256_ROTATE(v[0], 2) ^ SHA256_ROTATE(v[0], 13) ^ SHA256_ROTATE(v[0], 22);
+    uint32_t t2 = s0 + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+    memmove(v + 1, v, 7 * sizeof(v[0]));
+    v[4] += t1;
+    v[0] = t1 + t2;
+  }
+  for (i = 0; i < 8; i++) {
+    state[i] += v[i];
+  }
+}
+
+/*
+ * SHA-256 of data. --incremental trusts it to tell contents apart without
+ * reading the file back, which a fast hash such as hash_bytes() cannot be
+ * trusted with: its collisions are easy to make.
+ */
+static void content_digest(const char *data, size_t size, unsigned char digest[CONTENT_DIGEST_SIZE]) {
+  uint32_t state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  unsigned char tail[128] = {0};
+  size_t whole = size & ~(size_t)63;
+  size_t i;
+  
+  for (i = 0; i < whole; i += 64) {
+    sha256_block(state, (const unsigned char *)data + i);
+  }
+  // The last partial block, a 1 bit, zeros and the length in bits
+  size_t rest = size - whole;
+  size_t tail_size = rest < 56 ? 64 : 128;
+  unsigned long long bits = (unsigned long long)size * 8;
+  memcpy(tail, data + whole, rest);
+  tail[rest] = 0x80;
+  for (i = 0; i < 8; i++) {
+    tail[tail_size - 1 - i] = (unsigned char)(bits >> (i * 8));
+  }
+  for (i = 0; i < tail_size; i += 64) {
+    sha256_block(state, tail + i);
+  }
+  for (i = 0; i < 8; i++) {
+    digest[i * 4] = (unsigned char)(state[i] >> 24);
+    digest[i * 4 + 1] = (unsigned char)(state[i] >> 16);
+    digest[i * 4 + 2] = (unsigned char)(state[i] >> 8);
+    digest[i * 4 + 3] = (unsigned char)state[i];
+  }
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+  struct arena_block *block = arena->head;
+  
+  if (!block || block->size - block->used < size) {
+    size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    block = malloc(sizeof(*block) + block_size);
+    if (!block) return NULL;
+    block->next = arena->head;
+    block->used = 0;
+    block->size = block_size;
+    arena->head = block;
+  }
+  void *p = block->data + block->used;
+  block->used += size;
+  return p;
+}
+
+void arena_free(struct arena *arena) {
+  while (arena->head) {
+    struct arena_block *next = arena->head->next;
+    free(arena->head);
+    arena->head = next;
+  }
+}
+
+/* Slot holding dir, or the empty slot where it would go */
+static size_t dir_cache_slot(const struct dir_cache *cache, const char *dir,
+    size_t len, size_t hash) {
+  size_t mask = cache->capacity - 1;
+  size_t slot = hash & mask;
+  
+  while (cache->entries[slot]) {
+    if (cache->hashes[slot] == hash && strncmp(cache->entries[slot], dir, len) == 0 &&
+        cache->entries[slot][len] == '\0') {
+      break;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+int dir_cache_contains(const struct dir_cache *cache, const char *dir, size_t len) {
+  if (!cache || cache->count == 0) return 0;
+  return cache->entries[dir_cache_slot(cache, dir, len, hash_bytes(dir, len))] != NULL;
+}
+
+int dir_cache_insert(struct dir_cache *cache, const char *dir, size_t len) {
+  if (!cache) return -1;
+  
+  if ((cache->count + 1) * 2 > cache->capacity) {
+    size_t capacity = cache->capacity ? cache->capacity * 2 : 64;
+    char **entries = calloc(capacity, sizeof(*entries));
+    size_t *hashes = calloc(capacity, sizeof(*hashes));
+    if (!entries || !hashes) {
+      free(entries);
+      free(hashes);
+      return -1;
+    }
+    
+    size_t i;
+    for (i = 0; i < cache->capacity; i++) {
+      if (cache->entries[i]) {
+        size_t slot = cache->hashes[i] & (capacity - 1);
+        while (entries[slot]) {
+          slot = (slot + 1) & (capacity - 1);
+        }
+        entries[slot] = cache->entries[i];
+        hashes[slot] = cache->hashes[i];
+      }
+    }
+    free(cache->entries);
+    free(cache->hashes);
+    cache->entries = entries;
+    cache->hashes = hashes;
+    cache->capacity = capacity;
+  }
+  
+  size_t hash = hash_bytes(dir, len);
+  size_t slot = dir_cache_slot(cache, dir, len, hash);
+  if (cache->entries[slot]) return 0;
+  
+  char *copy = arena_alloc(&cache->names, len + 1);
+  if (!copy) return -1;
+  memcpy(copy, dir, len);
+  copy[len] = '\0';
+  cache->entries[slot] = copy;
+  cache->hashes[slot] = hash;
+  cache->count++;
+  return 0;
+}
+
+void dir_cache_share(struct dir_cache *cache) {
+  if (!cache || cache->shared) return;
+  mutex_init(&cache->lock);
+  cache->shared = 1;
+}
+
+void free_dir_cache(struct dir_cache *cache) {
+  if (!cache) return;
+  
+  if (cache->shared) {
+    mutex_destroy(&cache->lock);
+    cache->shared = 0;
+  }
+  
+  arena_free(&cache->names);
+  free(cache->entries);
+  free(cache->hashes);
+  cache->entries = NULL;
+  cache->hashes = NULL;
+  cache->count = 0;
+  cache->capacity = 0;
+}
+
+/* Slot holding path, or the empty slot where it would go */
+static size_t content_index_slot(const struct content_index *index, const char *path,
+    size_t hash) {
+  size_t mask = index->capacity - 1;
+  size_t slot = hash & mask;
+  
+  while (index->entries[slot].path) {
+    if (index->entries[slot].path_hash == hash && strcmp(index->entries[slot].path, path) == 0) {
+      break;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+/* Non-zero if full_path is still the file recorded for path, with digest as its content */
+int content_index_matches(const struct content_index *index, const char *path,
+    const char *full_path, size_t size, const unsigned char *digest) {
+  if (!index || index->count == 0) return 0;
+  
+  const struct content_entry *entry =
+      &index->entries[content_index_slot(index, path, hash_bytes(path, strlen(path)))];
+  if (!entry->path || entry->size != size || memcmp(entry->digest, digest, CONTENT_DIGEST_SIZE) != 0) {
+    return 0;
+  }
+  
+  struct stat st;
+  stat_add(STATS.stats, 1);
+  if (stat(full_path, &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+  return (size_t)st.st_size == size && (unsigned long long)st.st_ino == entry->inode &&
+      (long long)st.st_mtime == entry->mtime && STAT_MTIME_NSEC(&st) == entry->mtime_nsec;
+}
+
+/* Remembers that full_path now holds size bytes with the given digest */
+void content_index_record(struct content_index *index, const char *path, const char *full_path,
+    size_t size, const unsigned char *digest) {
+  struct stat st;
+  
+  stat_add(STATS.stats, 1);
+  if (!index || stat(full_path, &st) != 0) return;
+  
+  if ((index->count + 1) * 2 > index->capacity) {
+    size_t capacity = index->capacity ? index->capacity * 2 : 64;
+    struct content_entry *entries = calloc(capacity, sizeof(*entries));
+    if (!entries) return;
+    
+    size_t i;
+    for (i = 0; i < index->capacity; i++) {
+      if (index->entries[i].path) {
+        size_t slot = index->entries[i].path_hash & (capacity - 1);
+        while (entries[slot].path) {
+          slot = (slot + 1) & (capacity - 1);
+        }
+        entries[slot] = index->entries[i];
+      }
+    }
+    free(index->entries);
+    index->entries = entries;
+    index->capacity = capacity;
+  }
+  
+  size_t len = strlen(path);
+  size_t hash = hash_bytes(path, len);
+  struct content_entry *entry = &index->entries[content_index_slot(index, path, hash)];
+  if (!entry->path) {
+    char *copy = arena_alloc(&index->paths, len + 1);
+    if (!copy) return;
+    memcpy(copy, path, len + 1);
+    entry->path = copy;
+    entry->path_hash = hash;
+    index->count++;
+  }
+  entry->size = size;
+  memcpy(entry->digest, digest, CONTENT_DIGEST_SIZE);
+  entry->inode = (unsigned long long)st.st_ino;
+  entry->mtime = (long long)st.st_mtime;
+  entry->mtime_nsec = STAT_MTIME_NSEC(&st);
+}
+
+void free_content_index(struct content_index *index) {
+  if (!index) return;
+  arena_free(&index->paths);
+  free(index->entries);
+  index->entries = NULL;
+  index->count = 0;
+  index->capacity = 0;
+}
+
+#ifdef _WIN32
+/* Sets errno from a Win32 error, for the messages and the ENOENT retry */
+static void set_errno_from(DWORD error) {
+  switch (error) {
+    case ERROR_FILE_NOT_FOUND:
+    case ERROR_PATH_NOT_FOUND: errno = ENOENT; break;
+    case ERROR_ACCESS_DENIED:
+    case ERROR_SHARING_VIOLATION: errno = EACCES; break;
+    case ERROR_FILE_EXISTS:
+    case ERROR_ALREADY_EXISTS: errno = EEXIST; break;
+    case ERROR_DISK_FULL:
+    case ERROR_HANDLE_DISK_FULL: errno = ENOSPC; break;
+    case ERROR_FILENAME_EXCED_RANGE: errno = ENAMETOOLONG; break;
+    default: errno = EIO; break;
+  }
+}
+
+/*
+ * An output path for the wide Win32 calls. Transcripts are UTF-8; a path
+ * that is not valid UTF-8 is read in the ANSI code page, as the narrow
+ * calls read every path before.
+ */
+static int wide_path(const char *path, wchar_t *wide, int count) {
+  if (MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, path, -1, wide, count) > 0 ||
+      MultiByteToWideChar(CP_ACP, 0, path, -1, wide, count) > 0) {
+    return 0;
+  }
+  errno = ENAMETOOLONG;
+  return -1;
+}
+
+/*
+ * Runs "tool args" on the given standard handles with no shell in between,
+ * so a file name never becomes part of a command line. Returns the
+ * process, or NULL with errno set.
+ */
+static HANDLE spawn_tool(const char *tool, const char *args, HANDLE input, HANDLE output) {
+  char command[64];
+  STARTUPINFOA startup;
+  PROCESS_INFORMATION process;
+  
+  snprintf(command, sizeof(command), "%s %s", tool, args);
+  memset(&startup, 0, sizeof(startup));
+  startup.cb = sizeof(startup);
+  startup.dwFlags = STARTF_USESTDHANDLES;
+  startup.hStdInput = input;
+  startup.hStdOutput = output;
+  startup.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+  
+  // Only for the call: the handles ai2fs keeps must not leak into later children
+  SetHandleInformation(input, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+  SetHandleInformation(output, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+  BOOL started = CreateProcessA(NULL, command, NULL, NULL, TRUE, 0, NULL, NULL, &startup, &process);
+  DWORD error = GetLastError();
+  SetHandleInformation(input, HANDLE_FLAG_INHERIT, 0);
+  SetHandleInformation(output, HANDLE_FLAG_INHERIT, 0);
+  if (!started) {
+    set_errno_from(error);
+    return NULL;
+  }
+  CloseHandle(process.hThread);
+  return process.hProcess;
+}
+
+/* Reaps a tool from spawn_tool(); -1 unless it exited with 0 */
+static int wait_tool(HANDLE process) {
+  DWORD code = 1;
+  
+  WaitForSingleObject(process, INFINITE);
+  if (!GetExitCodeProcess(process, &code)) code = 1;
+  CloseHandle(process);
+  return code == 0 ? 0 : -1;
+}
+#endif
+
+/* Creates one directory; an existing one counts as success */
+static int make_directory(const char *dir) {
+  double start = stat_clock();
+  stat_add(STATS.mkdirs, 1);
+  #ifdef _WIN32
+    wchar_t wide[MAX_PATH_LENGTH];
+    int result = -1;
+    if (wide_path(dir, wide, MAX_PATH_LENGTH) == 0) {
+      if (CreateDirectoryW(wide, NULL)) {
+        result = 0;
+      } else {
+        set_errno_from(GetLastError());
+      }
+    }
+  #else
+    int result = mkdir(dir, S_IRWXU);
+  #endif
+  stat_time(STATS.mkdir_ns, start);
+  return (result == 0 || errno == EEXIST) ? 0 : -1;
+}
+
+void create_directories(struct dir_cache *cache, const char *root, const char *path) {
+  if (!path) return;
+  
+  if (cache && cache->shared) {
+    mutex_lock(&cache->lock);
+  }
+  
+  char temp[MAX_PATH_LENGTH];
+  char *p;
+  
+  // Prepend root folder to path; a path that does not fit fails when it is opened
+  int len = snprintf(temp, sizeof(temp), "%s/%s", root, path);
+  
+  // Nothing to do when the file's parent was already created this run
+  char *parent = strrchr(temp, '/');
+  if (len >= 0 && (size_t)len < sizeof(temp) && !dir_cache_contains(cache, temp, parent - temp)) {
+    // Create every missing prefix, the root folder included, outermost first
+    for (p = temp + 1; *p; p++) {
+      if (*p == '/' && !dir_cache_contains(cache, temp, p - temp)) {
+        *p = '\0';
+        if (make_directory(temp) == 0) {
+          dir_cache_insert(cache, temp, p - temp);
+        }
+        *p = '/';
+      }
+    }
+  }
+  
+  if (cache && cache->shared) {
+    mutex_unlock(&cache->lock);
+  }
+}
+
+/* Non-zero if the file at full_path holds exactly size bytes equal to data */
+int file_has_content(const char *full_path, const char *data, size_t size) {
+  // Text mode may translate line endings on disk, so only compare sizes on POSIX
+  #ifndef _WIN32
+    struct stat st;
+    stat_add(STATS.stats, 1);
+    if (stat(full_path, &st) != 0 || !S_ISREG(st.st_mode) || (size_t)st.st_size != size) {
+      return 0;
+    }
+  #endif
+  
+  double start = stat_clock();
+  stat_add(STATS.opens, 1);
+  #ifdef _WIN32
+    wchar_t wide[MAX_PATH_LENGTH];
+    int fd = wide_path(full_path, wide, MAX_PATH_LENGTH) == 0 ? _wopen(wide, _O_RDONLY | _O_TEXT) : -1;
+  #else
+    int fd = open(full_path, O_RDONLY);
+  #endif
+  stat_time(STATS.open_ns, start);
+  if (fd < 0) return 0;
+  
+  char chunk[COMPARE_CHUNK_SIZE];
+  size_t offset = 0;
+  int same = 1;
+  for (;;) {
+    #ifdef _WIN32
+      int n = _read(fd, chunk, sizeof(chunk));
+    #else
+      ssize_t n = read(fd, chunk, sizeof(chunk));
+      if (n < 0 && errno == EINTR) continue;
+    #endif
+    if (n < 0) same = 0;
+    if (n <= 0) break;
+    if ((size_t)n > size - offset || memcmp(chunk, data + offset, n) != 0) {
+      same = 0;
+      break;
+    }
+    offset += n;
+  }
+  #ifdef _WIN32
+    _close(fd);
+  #else
+    close(fd);
+  #endif
+  return same && offset == size;
+}
+
+/*
+ * Output files are written through plain descriptors: every write is a
+ * whole slice of the input, so stdio would only add a FILE and a buffer
+ * allocation per file. Windows keeps text mode, as fopen "w" did, on a
+ * handle from CreateFileW: it takes the same sharing and disposition as
+ * _open did, plus the sequential-access hint.
+ */
+static int open_output(const char *full_path) {
+  double start = stat_clock();
+  stat_add(STATS.opens, 1);
+  #ifdef _WIN32
+    wchar_t wide[TEMP_PATH_LENGTH];
+    int fd = -1;
+    if (wide_path(full_path, wide, TEMP_PATH_LENGTH) == 0) {
+      HANDLE handle = CreateFileW(wide, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+          CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+      if (handle == INVALID_HANDLE_VALUE) {
+        set_errno_from(GetLastError());
+      } else {
+        fd = _open_osfhandle((intptr_t)handle, _O_WRONLY | _O_TEXT);
+        if (fd < 0) CloseHandle(handle);
+      }
+    }
+  #else
+    int fd = open(full_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  #endif
+  stat_time(STATS.open_ns, start);
+  return fd;
+}
+
+/* Writes all of data; -1 with errno set if the descriptor stops taking it */
+static int write_output(int fd, const char *data, size_t size) {
+  double start = stat_clock();
+  stat_add(STATS.writes, 1);
+  stat_add(STATS.bytes_written, size);
+  #ifdef AI2FS_BENCH
+    // --write-delay-us stands in for a slow disk
+    if (BENCH_WRITE_DELAY_US > 0) {
+      #ifdef _WIN32
+        Sleep((DWORD)(BENCH_WRITE_DELAY_US / 1000));
+      #else
+        struct timespec delay = { BENCH_WRITE_DELAY_US / 1000000, (BENCH_WRITE_DELAY_US % 1000000) * 1000 };
+        nanosleep(&delay, NULL);
+      #endif
+    }
+  #endif
+  while (size > 0) {
+    #ifdef _WIN32
+      int n = _write(fd, data, size > INT_MAX ? INT_MAX : (unsigned)size);
+    #else
+      ssize_t n = write(fd, data, size);
+      if (n < 0 && errno == EINTR) continue;
+    #endif
+    // A write that takes nothing sets no errno of its own
+    if (n == 0) errno = EIO;
+    if (n <= 0) break;
+    data += n;
+    size -= (size_t)n;
+  }
+  stat_time(STATS.write_ns, start);
+  return size > 0 ? -1 : 0;
+}
+
+/*
+ * Reserves size bytes for a file about to be written in one go, so a large
+ * file gets few extents instead of growing a write at a time. It is only a
+ * hint: filesystems that cannot do it are left to allocate as they write.
+ */
+static void preallocate_output(int fd, size_t size) {
+  if (size < PREALLOCATE_MIN) return;
+  
+  #ifdef _WIN32
+    FILE_ALLOCATION_INFO info;
+    info.AllocationSize.QuadPart = (LONGLONG)size;
+    SetFileInformationByHandle((HANDLE)_get_osfhandle(fd), FileAllocationInfo, &info, sizeof(info));
+  #elif defined(_POSIX_ADVISORY_INFO) && _POSIX_ADVISORY_INFO > 0
+    posix_fallocate(fd, 0, (off_t)size);
+  #else
+    (void)fd;
+  #endif
+}
+
+/* Closes an output; -1 with errno set if the file system reports a lost write */
+static int close_output(int fd) {
+  double start = stat_clock();
+  #ifdef _WIN32
+    int status = _close(fd);
+  #else
+    int status = close(fd);
+  #endif
+  stat_time(STATS.write_ns, start);
+  return status;
+}
+
+#ifndef _WIN32
+/*
+ * Pipes and sockets are close-on-exec, so a compressor or decompressor
+ * that another thread starts does not hold them open. On Linux they are
+ * created that way; elsewhere a fork can still slip in before the flag
+ * is set.
+ */
+#ifndef __linux__
+static void set_cloexec(int fd) {
+  fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+}
+#endif
+
+static int open_pipe(int fds[2]) {
+  #ifdef __linux__
+    return pipe2(fds, O_CLOEXEC);
+  #else
+    if (pipe(fds) != 0) return -1;
+    set_cloexec(fds[0]);
+    set_cloexec(fds[1]);
+    return 0;
+  #endif
+}
+#endif
+
+void log_init(struct progress_log *log) {
+  log->length = 0;
+  log->fd = -1;
+  mutex_init(&log->lock);
+}
+
+static void log_drain(struct progress_log *log) {
+  if (log->length == 0) return;
+  #ifndef _WIN32
+    // A client that hangs up early only loses its messages
+    if (log->fd >= 0) {
+      const char *p = log->buffer;
+      size_t left = log->length;
+      while (left > 0) {
+        ssize_t n = write(log->fd, p, left);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        p += n;
+        left -= (size_t)n;
+      }
+      log->length = 0;
+      return;
+    }
+  #endif
+  fwrite(log->buffer, 1, log->length, stdout);
+  fflush(stdout);
+  log->length = 0;
+}
+
+/* Queues the line prefix + text + suffix; text is at most a path long */
+void log_message(struct progress_log *log, const char *prefix, const char *text,
+    const char *suffix) {
+  if (!log) {
+    printf("%s%s%s\n", prefix, text, suffix);
+    return;
+  }
+  
+  size_t prefix_len = strlen(prefix);
+  size_t text_len = strlen(text);
+  size_t suffix_len = strlen(suffix);
+  size_t len = prefix_len + text_len + suffix_len + 1;
+  
+  mutex_lock(&log->lock);
+  if (log->length + len > sizeof(log->buffer)) {
+    log_drain(log);
+  }
+  if (len > sizeof(log->buffer)) {
+    printf("%s%s%s\n", prefix, text, suffix);
+  } else {
+    char *p = log->buffer + log->length;
+    memcpy(p, prefix, prefix_len);
+    memcpy(p + prefix_len, text, text_len);
+    memcpy(p + prefix_len + text_len, suffix, suffix_len);
+    p[len - 1] = '\n';
+    log->length += len;
+  }
+  mutex_unlock(&log->lock);
+}
+
+/* Writes out the queued messages; also orders them before later printf output */
+void log_flush(struct progress_log *log) {
+  if (!log) return;
+  mutex_lock(&log->lock);
+  log_drain(log);
+  mutex_unlock(&log->lock);
+}
+
+void log_destroy(struct progress_log *log) {
+  log_flush(log);
+  mutex_destroy(&log->lock);
+}
+
+/* Reports what happened to one file unless the output is quiet */
+static void report_file(const struct output *out, const char *action, const char *path) {
+  if (out->quiet) return;
+  double start = stat_clock();
+  log_message(out->log, action, " file: ", path);
+  stat_time(STATS.log_ns, start);
+}
+
+static void count_write(struct write_totals *totals, enum write_status status) {
+  if (!totals) return;
+  
+  mutex_lock(&totals->lock);
+  switch (status) {
+    case WRITE_CREATED: totals->created++; break;
+    case WRITE_UPDATED: totals->updated++; break;
+    case WRITE_UNCHANGED: totals->unchanged++; break;
+    default: totals->failed++; break;
+  }
+  mutex_unlock(&totals->lock);
+}
+
+/* A file whose full path does not fit; a --serve client hears of it too */
+static void report_too_long(const struct output *out, const char *path) {
+  fprintf(stderr, "Error creating file %s/%s: %s\n", out->root, path, strerror(ENAMETOOLONG));
+  if (out->log && out->log->fd >= 0) log_message(out->log, "Error: path too long: ", path, "");
+  count_write(out->totals, WRITE_FAILED);
+}
+
+/*
+ * Joins root and path into full_path. A result that does not fit fails
+ * with ENAMETOOLONG instead of naming some other, cut-off file.
+ */
+static int output_path(char *full_path, size_t size, const char *root, const char *path) {
+  int len = snprintf(full_path, size, "%s/%s", root, path);
+  if (len < 0 || (size_t)len >= size) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * A fresh name for writing path with --atomic, in the directory it ends up
+ * in so the rename stays on one filesystem. The name is short, so a file
+ * name near the length limit still gets a temporary one; like
+ * output_path() it fails with ENAMETOOLONG rather than cut it off.
+ */
+static int temp_path_for(char *temp_path, size_t size, const char *root, const char *path) {
+  static unsigned long next_temp;
+  const char *slash = strrchr(path, '/');
+  int dir_len = slash ? (int)(slash - path + 1) : 0;
+  int len;
+  
+  #ifdef _WIN32
+    unsigned long n = (unsigned long)InterlockedIncrement((volatile LONG *)&next_temp);
+    len = snprintf(temp_path, size, "%s/%.*s.ai2fs-%d-%lu.tmp", root, dir_len, path, _getpid(), n);
+  #else
+    unsigned long n = __atomic_add_fetch(&next_temp, 1, __ATOMIC_RELAXED);
+    len = snprintf(temp_path, size, "%s/%.*s.ai2fs-%ld-%lu.tmp", root, dir_len, path, (long)getpid(), n);
+  #endif
+  if (len < 0 || (size_t)len >= size) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  return 0;
+}
+
+/* Moves a finished temporary file over its target */
+static int replace_file(const char *temp_path, const char *full_path) {
+  #ifdef _WIN32
+    wchar_t wide_temp[TEMP_PATH_LENGTH];
+    wchar_t wide_full[MAX_PATH_LENGTH];
+    if (wide_path(temp_path, wide_temp, TEMP_PATH_LENGTH) != 0 ||
+        wide_path(full_path, wide_full, MAX_PATH_LENGTH) != 0) {
+      return -1;
+    }
+    if (!MoveFileExW(wide_temp, wide_full, MOVEFILE_REPLACE_EXISTING)) {
+      set_errno_from(GetLastError());
+      return -1;
+    }
+    return 0;
+  #else
+    return rename(temp_path, full_path);
+  #endif
+}
+
+/* Removes a partly written output, or what is left of a failed atomic write */
+static void remove_output(const char *path) {
+  #ifdef _WIN32
+    wchar_t wide[TEMP_PATH_LENGTH];
+    if (wide_path(path, wide, TEMP_PATH_LENGTH) == 0) DeleteFileW(wide);
+  #else
+    remove(path);
+  #endif
+}
+
+/* Renames an atomic write into place; on failure the temporary file is removed */
+static int commit_output(const struct output *out, const char *temp_path, const char *full_path) {
+  if (!out->atomic) return 0;
+  if (replace_file(temp_path, full_path) != 0) {
+    fprintf(stderr, "Error renaming %s to %s: %s\n", temp_path, full_path, strerror(errno));
+    remove_output(temp_path);
+    count_write(out->totals, WRITE_FAILED);
+    return -1;
+  }
+  return 0;
+}
+
+enum write_status write_file_block(const struct output *out, const char *path,
+    const char *data, size_t size) {
+  char full_path[MAX_PATH_LENGTH];
+  char temp_path[TEMP_PATH_LENGTH];
+  int existed = 0;
+  if (output_path(full_path, sizeof(full_path), out->root, path) != 0 ||
+      (out->atomic && temp_path_for(temp_path, sizeof(temp_path), out->root, path) != 0)) {
+    report_too_long(out, path);
+    return WRITE_FAILED;
+  }
+  
+  // Skip byte-identical files so their mtime and downstream caches survive
+  unsigned char digest[CONTENT_DIGEST_SIZE];
+  if (out->incremental) {
+    int same = 0;
+    if (out->index) {
+      content_digest(data, size, digest);
+      same = content_index_matches(out->index, path, full_path, size, digest);
+    }
+    if (!same && file_has_content(full_path, data, size)) {
+      same = 1;
+      if (out->index) content_index_record(out->index, path, full_path, size, digest);
+    }
+    if (same) {
+      report_file(out, "Unchanged", path);
+      count_write(out->totals, WRITE_UNCHANGED);
+      return WRITE_UNCHANGED;
+    }
+    stat_add(STATS.stats, 1);
+    #ifdef _WIN32
+      wchar_t wide[MAX_PATH_LENGTH];
+      existed = wide_path(full_path, wide, MAX_PATH_LENGTH) == 0 &&
+          GetFileAttributesW(wide) != INVALID_FILE_ATTRIBUTES;
+    #else
+      struct stat st;
+      existed = (stat(full_path, &st) == 0);
+    #endif
+  }
+  
+  int output_fd = open_output(out->atomic ? temp_path : full_path);
+  // A cache kept warm by --serve may list a directory removed since
+  if (output_fd < 0 && errno == ENOENT && out->dirs && out->dirs->count > 0) {
+    create_directories(NULL, out->root, path);
+    output_fd = open_output(out->atomic ? temp_path : full_path);
+  }
+  if (output_fd < 0) {
+    fprintf(stderr, "Error creating file %s: %s\n", 
+        full_path, strerror(errno));
+    count_write(out->totals, WRITE_FAILED);
+    return WRITE_FAILED;
+  }
+  
+  preallocate_output(output_fd, size);
+  // A short write must never be renamed over the old file with --atomic
+  int failed = write_output(output_fd, data, size) != 0;
+  int error = errno;
+  if (close_output(output_fd) != 0 && !failed) {
+    failed = 1;
+    error = errno;
+  }
+  if (failed) {
+    fprintf(stderr, "Error writing file %s: %s\n", full_path, strerror(error));
+    remove_output(out->atomic ? temp_path : full_path);
+    count_write(out->totals, WRITE_FAILED);
+    return WRITE_FAILED;
+  }
+  if (commit_output(out, temp_path, full_path) != 0) return WRITE_FAILED;
+  if (out->index) content_index_record(out->index, path, full_path, size, digest);
+  
+  enum write_status status = existed ? WRITE_UPDATED : WRITE_CREATED;
+  report_file(out, status == WRITE_UPDATED ? "Updated" : "Created", path);
+  count_write(out->totals, status);
+  return status;
+}
+
+/* Wakes the other side of a queue if it has gone to sleep on cond */
+static void queue_wake(struct write_queue *queue, unsigned long long *waiting, cond_handle *cond) {
+  if (!ring_load(waiting)) return;
+  mutex_lock(&queue->lock);
+  cond_signal(cond);
+  mutex_unlock(&queue->lock);
+}
+
+/* Non-zero once the writer has a job to take, or the queue is closed and empty */
+static int queue_readable(struct write_queue *queue, unsigned long long head) {
+  return ring_load(&queue->tail) != head || ring_load(&queue->closed);
+}
+
+/* Non-zero once a job of size bytes fits: a free slot, and room under the byte cap */
+static int queue_writable(struct write_queue *queue, size_t size) {
+  unsigned long long bytes = ring_load(&queue->bytes);
+  return queue->tail - ring_load(&queue->head) < WRITE_QUEUE_DEPTH &&
+      (bytes == 0 || bytes + size <= WRITE_QUEUE_BYTES);
+}
+
+static THREAD_RETURN writer_thread(void *arg) {
+  struct write_queue *queue = arg;
+  unsigned long long head = 0;
+  struct write_job job;
+  
+  for (;;) {
+    int spins = 0;
+    while (!queue_readable(queue, head)) {
+      if (++spins < WRITE_QUEUE_SPINS) continue;
+      // Announce the sleep, then look again so a job queued meanwhile is not missed
+      mutex_lock(&queue->lock);
+      ring_store(&queue->writer_waiting, 1);
+      if (!queue_readable(queue, head)) cond_wait(&queue->not_empty, &queue->lock);
+      ring_store(&queue->writer_waiting, 0);
+      mutex_unlock(&queue->lock);
+    }
+    if (ring_load(&queue->tail) == head) break;
+    
+    job = queue->jobs[head % WRITE_QUEUE_DEPTH];
+    ring_store(&queue->head, ++head);
+    queue_wake(queue, &queue->submitter_waiting, &queue->not_full);
+    
+    create_directories(job.out->dirs, job.out->root, job.path);
+    write_file_block(job.out, job.path, job.data, job.size);
+    ring_add(&queue->bytes, 0 - (unsigned long long)job.size);
+    queue_wake(queue, &queue->submitter_waiting, &queue->not_full);
+  }
+  return 0;
+}
+
+int writer_pool_start(struct writer_pool *pool, int size, struct dir_cache *dirs) {
+  if (!pool || size < 1) return -1;
+  
+  pool->queues = calloc(size, sizeof(*pool->queues));
+  pool->threads = calloc(size, sizeof(*pool->threads));
+  pool->size = 0;
+  if (!pool->queues || !pool->threads) {
+    free(pool->queues);
+    free(pool->threads);
+    return -1;
+  }
+  dir_cache_share(dirs);
+  
+  int i;
+  for (i = 0; i < size; i++) {
+    struct write_queue *queue = &pool->queues[i];
+    mutex_init(&queue->lock);
+    cond_init(&queue->not_empty);
+    cond_init(&queue->not_full);
+    if (thread_start(&pool->threads[i], writer_thread, queue) != 0) {
+      mutex_destroy(&queue->lock);
+      cond_destroy(&queue->not_empty);
+      cond_destroy(&queue->not_full);
+      break;
+    }
+    pool->size++;
+  }
+  
+  if (pool->size == 0) {
+    writer_pool_finish(pool);
+    return -1;
+  }
+  return 0;
+}
+
+/* An ordered job goes to the first writer, so ordered jobs land in submission order */
+void writer_pool_submit(struct writer_pool *pool, const struct output *out, const char *path,
+    const char *data, size_t size, int ordered) {
+  size_t shard = ordered ? 0 : hash_bytes(path, strlen(path)) % pool->size;
+  struct write_queue *queue = &pool->queues[shard];
+  int spins = 0;
+  
+  while (!queue_writable(queue, size)) {
+    if (++spins < WRITE_QUEUE_SPINS) continue;
+    mutex_lock(&queue->lock);
+    ring_store(&queue->submitter_waiting, 1);
+    if (!queue_writable(queue, size)) {
+      stat_add(STATS.writer_stalls, 1);
+      cond_wait(&queue->not_full, &queue->lock);
+    }
+    ring_store(&queue->submitter_waiting, 0);
+    mutex_unlock(&queue->lock);
+  }
+  
+  struct write_job *job = &queue->jobs[queue->tail % WRITE_QUEUE_DEPTH];
+  job->out = out;
+  snprintf(job->path, sizeof(job->path), "%s", path);
+  job->data = data;
+  job->size = size;
+  ring_add(&queue->bytes, (unsigned long long)size);
+  ring_store(&queue->tail, queue->tail + 1);
+  queue_wake(queue, &queue->writer_waiting, &queue->not_empty);
+}
+
+/* Drains every queue, joins the writers and frees the pool */
+void writer_pool_finish(struct writer_pool *pool) {
+  if (!pool || !pool->queues) return;
+  
+  int i;
+  for (i = 0; i < pool->size; i++) {
+    ring_store(&pool->queues[i].closed, 1);
+    queue_wake(&pool->queues[i], &pool->queues[i].writer_waiting, &pool->queues[i].not_empty);
+  }
+  for (i = 0; i < pool->size; i++) {
+    thread_join(pool->threads[i]);
+    mutex_destroy(&pool->queues[i].lock);
+    cond_destroy(&pool->queues[i].not_empty);
+    cond_destroy(&pool->queues[i].not_full);
+  }
+  free(pool->queues);
+  free(pool->threads);
+  pool->queues = NULL;
+  pool->threads = NULL;
+  pool->size = 0;
+}
+
+/*
+ * ustar archive output for --output=tar:FILE. Files are appended in input
+ * order under root/path, so extracting the archive gives the same tree as
+ * a normal run (a repeated path is overwritten by its later entry). Small
+ * entries are gathered in a TAR_BUFFER_SIZE buffer; big bodies are written
+ * straight from the input. A .zst or .gz name pipes the archive through
+ * zstd or gzip.
+ */
+static void tar_drain(struct tar_sink *tar) {
+  if (tar->length > 0 && !tar->failed && write_output(tar->fd, tar->buffer, tar->length) != 0) {
+    tar->failed = errno ? errno : EIO;
+  }
+  tar->length = 0;
+}
+
+static void tar_put(struct tar_sink *tar, const char *data, size_t size) {
+  // A big body goes out directly, so whatever it follows goes first
+  if (size >= TAR_BUFFER_SIZE / 2 || tar->length + size > TAR_BUFFER_SIZE) {
+    tar_drain(tar);
+  }
+  if (size >= TAR_BUFFER_SIZE / 2) {
+    if (!tar->failed && write_output(tar->fd, data, size) != 0) {
+      tar->failed = errno ? errno : EIO;
+    }
+    return;
+  }
+  memcpy(tar->buffer + tar->length, data, size);
+  tar->length += size;
+}
+
+static void tar_pad(struct tar_sink *tar, size_t size) {
+  static const char zeros[TAR_BLOCK_SIZE];
+  if (size % TAR_BLOCK_SIZE) {
+    tar_put(tar, zeros, TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE);
+  }
+}
+
+static void tar_octal(char *field, size_t width, unsigned long long value) {
+  snprintf(field, width, "%0*llo", (int)(width - 1), value);
+}
+
+static void tar_header(struct tar_sink *tar, const char *name, const char *prefix, char type,
+    unsigned long long size) {
+  char header[TAR_BLOCK_SIZE];
+  unsigned sum = 0;
+  size_t i;
+  
+  memset(header, 0, sizeof(header));
+  memcpy(header, name, strlen(name) > 100 ? 100 : strlen(name));
+  tar_octal(header + 100, 8, 0644);
+  tar_octal(header + 108, 8, 0);
+  tar_octal(header + 116, 8, 0);
+  tar_octal(header + 124, 12, size > TAR_MAX_OCTAL ? 0 : size);
+  tar_octal(header + 136, 12, tar->mtime);
+  memset(header + 148, ' ', 8);
+  header[156] = type;
+  memcpy(header + 257, "ustar", 6);
+  memcpy(header + 263, "00", 2);
+  if (prefix) memcpy(header + 345, prefix, strlen(prefix));
+  
+  for (i = 0; i < sizeof(header); i++) {
+    sum += (unsigned char)header[i];
+  }
+  snprintf(header + 148, 8, "%06o", sum);
+  header[155] = ' ';
+  tar_put(tar, header, sizeof(header));
+}
+
+/* Appends one pax record, "<length> key=value\n", where length counts itself */
+static size_t pax_record(char *out, size_t room, const char *key, const char *value) {
+  size_t body = strlen(key) + strlen(value) + 3;
+  size_t len = body + 1;
+  while ((size_t)snprintf(NULL, 0, "%lu", (unsigned long)len) + body != len) {
+    len++;
+  }
+  snprintf(out, room, "%lu %s=%s\n", (unsigned long)len, key, value);
+  return len;
+}
+
+void tar_add(struct tar_sink *tar, const struct output *out, const char *path,
+    const char *data, size_t size) {
+  // Limited like the full path of a loose file, so both take the same files
+  char name[MAX_PATH_LENGTH];
+  if (output_path(name, sizeof(name), out->root, path) != 0) {
+    report_too_long(out, path);
+    return;
+  }
+  int name_len = (int)strlen(name);
+  
+  // A trailing slash would make the entry a directory, as it cannot be a file on disk
+  if (name[name_len - 1] == '/') {
+    fprintf(stderr, "Error creating file %s: %s\n", name, strerror(EISDIR));
+    count_write(out->totals, WRITE_FAILED);
+    return;
+  }
+  
+  char prefix[156] = {0};
+  const char *short_name = name;
+  int fits = name_len <= 100;
+  
+  // Long names split into the ustar prefix at a slash, or get a pax header
+  if (!fits) {
+    int i;
+    for (i = name_len - 1; i > 0; i--) {
+      if (name[i] == '/' && i <= 155 && name_len - i - 1 <= 100 && name_len - i - 1 > 0) {
+        memcpy(prefix, name, i);
+        short_name = name + i + 1;
+        fits = 1;
+        break;
+      }
+    }
+  }
+  
+  mutex_lock(&tar->lock);
+  if (!fits || size > TAR_MAX_OCTAL) {
+    char records[TEMP_PATH_LENGTH + 64];
+    size_t len = 0;
+    if (!fits) len += pax_record(records, sizeof(records), "path", name);
+    if (size > TAR_MAX_OCTAL) {
+      char digits[24];
+      snprintf(digits, sizeof(digits), "%llu", (unsigned long long)size);
+      len += pax_record(records + len, sizeof(records) - len, "size", digits);
+    }
+    tar_header(tar, "././@PaxHeader", NULL, 'x', len);
+    tar_put(tar, records, len);
+    tar_pad(tar, len);
+  }
+  tar_header(tar, short_name, prefix[0] ? prefix : NULL, '0', size);
+  tar_put(tar, data, size);
+  tar_pad(tar, size);
+  int failed = tar->failed;
+  mutex_unlock(&tar->lock);
+  
+  if (failed) {
+    count_write(out->totals, WRITE_FAILED);
+    return;
+  }
+  report_file(out, "Archived", path);
+  count_write(out->totals, WRITE_CREATED);
+}
+
+static const char *tar_compressor(const char *archive) {
+  size_t len = strlen(archive);
+  if (len > 4 && strcmp(archive + len - 4, ".zst") == 0) return "zstd";
+  if (len > 3 && strcmp(archive + len - 3, ".gz") == 0) return "gzip";
+  return NULL;
+}
+
+/* Creates the archive (under a temporary name with atomic) and, for .zst/.gz, its compressor */
+int tar_open(struct tar_sink *tar, const char *archive, int atomic) {
+  memset(tar, 0, sizeof(*tar));
+  tar->fd = -1;
+  tar->archive = archive;
+  tar->atomic = atomic;
+  tar->buffer = malloc(TAR_BUFFER_SIZE);
+  if (!tar->buffer) return -1;
+  
+  // SOURCE_DATE_EPOCH gives reproducible archives
+  const char *epoch = getenv("SOURCE_DATE_EPOCH");
+  tar->mtime = epoch ? strtoull(epoch, NULL, 10) : (unsigned long long)time(NULL);
+  
+  #ifdef _WIN32
+    snprintf(tar->target, sizeof(tar->target), "%s.ai2fs-%d.tmp", archive, _getpid());
+  #else
+    snprintf(tar->target, sizeof(tar->target), "%s.ai2fs-%ld.tmp", archive, (long)getpid());
+  #endif
+  if (!atomic) snprintf(tar->target, sizeof(tar->target), "%s", archive);
+  
+  const char *compressor = tar_compressor(archive);
+  #ifdef _WIN32
+    if (compressor) {
+      // The compressor writes straight into the archive it is handed open
+      wchar_t wide[TEMP_PATH_LENGTH];
+      HANDLE file = INVALID_HANDLE_VALUE;
+      HANDLE reader, writer;
+      if (wide_path(tar->target, wide, TEMP_PATH_LENGTH) == 0) {
+        file = CreateFileW(wide, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) set_errno_from(GetLastError());
+      }
+      if (file != INVALID_HANDLE_VALUE && !CreatePipe(&reader, &writer, NULL, 0)) {
+        set_errno_from(GetLastError());
+        CloseHandle(file);
+        DeleteFileW(wide);
+        file = INVALID_HANDLE_VALUE;
+      }
+      if (file != INVALID_HANDLE_VALUE) {
+        tar->process = spawn_tool(compressor, "-q -c", reader, file);
+        CloseHandle(reader);
+        CloseHandle(file);
+        tar->fd = tar->process ? _open_osfhandle((intptr_t)writer, _O_WRONLY | _O_BINARY) : -1;
+        if (tar->fd < 0) {
+          int error = errno;
+          CloseHandle(writer);
+          if (tar->process) wait_tool(tar->process);
+          tar->process = NULL;
+          DeleteFileW(wide);
+          errno = error;
+        }
+      }
+    } else {
+      tar->fd = _open(tar->target, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+    }
+  #else
+    tar->fd = open(tar->target, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    int fds[2];
+    if (tar->fd >= 0 && compressor && open_pipe(fds) != 0) {
+      int error = errno;
+      close(tar->fd);
+      tar->fd = -1;
+      remove(tar->target);
+      errno = error;
+    } else if (tar->fd >= 0 && compressor) {
+      tar->child = fork();
+      if (tar->child == 0) {
+        dup2(fds[0], STDIN_FILENO);
+        dup2(tar->fd, STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        close(tar->fd);
+        execlp(compressor, compressor, "-q", "-c", (char *)NULL);
+        _exit(127);
+      }
+      int error = errno;
+      close(fds[0]);
+      close(tar->fd);
+      tar->fd = fds[1];
+      if (tar->child < 0) {
+        close(tar->fd);
+        tar->fd = -1;
+        remove(tar->target);
+        errno = error;
+      } else {
+        // A compressor that is missing or dies must show up as EPIPE, not kill ai2fs
+        tar->saved_sigpipe = signal(SIGPIPE, SIG_IGN);
+      }
+    }
+  #endif
+  if (tar->fd < 0) {
+    free(tar->buffer);
+    tar->buffer = NULL;
+    return -1;
+  }
+  
+  mutex_init(&tar->lock);
+  return 0;
+}
+
+/* Ends the archive; reports and returns -1 if any part of it failed */
+int tar_close(struct tar_sink *tar) {
+  static const char end_blocks[TAR_BLOCK_SIZE * 2];
+  
+  tar_put(tar, end_blocks, sizeof(end_blocks));
+  tar_drain(tar);
+  int failed = tar->failed;
+  
+  #ifdef _WIN32
+    if (_close(tar->fd) != 0 && !failed) failed = errno;
+    if (tar->process && wait_tool(tar->process) != 0) failed = EPIPE;
+  #else
+    if (close(tar->fd) != 0 && !failed) failed = errno;
+    if (tar->child > 0) {
+      int status = 0;
+      pid_t waited;
+      while ((waited = waitpid(tar->child, &status, 0)) < 0 && errno == EINTR) {
+      }
+      if (waited < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = EPIPE;
+      signal(SIGPIPE, tar->saved_sigpipe);
+    }
+  #endif
+  
+  if (!failed && tar->atomic && replace_file(tar->target, tar->archive) != 0) {
+    failed = errno;
+  }
+  // A partial archive is worse than none, with or without --atomic
+  if (failed) {
+    fprintf(stderr, "Error writing archive %s: %s\n", tar->archive,
+        failed == EPIPE && tar_compressor(tar->archive) ? "compressor failed" : strerror(failed));
+    remove(tar->target);
+  }
+  
+  mutex_destroy(&tar->lock);
+  free(tar->buffer);
+  tar->buffer = NULL;
+  return failed ? -1 : 0;
+}
+
+#ifdef AI2FS_URING
+/*
+ * io_uring output for the sequential path. Each file becomes a linked
+ * openat -> write -> close chain (plus renameat with --atomic) on a
+ * registered descriptor slot, so a batch of URING_BATCH files goes out in
+ * one io_uring_enter. Files of PREALLOCATE_MIN bytes or more get a
+ * fallocate before the write, until the filesystem turns it down. Each
+ * step is tagged in user_data, so a short write and a failed rename are
+ * caught as well as errors. A file whose chain fails anywhere loses its
+ * temporary file and is rewritten through write_file_block(), which also
+ * reports the error.
+ */
+#define URING_FALLOCATE_TAG ((__u64)1 << 32)
+#define URING_WRITE_TAG ((__u64)1 << 33)
+#define URING_RENAME_TAG ((__u64)1 << 34)
+#define URING_STEP_TAGS (URING_FALLOCATE_TAG | URING_WRITE_TAG | URING_RENAME_TAG)
+
+struct uring_file {
+  const struct output *out;
+  char path[MAX_PATH_LENGTH];
+  char full_path[MAX_PATH_LENGTH];
+  char temp_path[TEMP_PATH_LENGTH];
+  const char *data;
+  size_t size;
+  int failed;
+};
+
+struct uring {
+  int fd;
+  void *ring;
+  size_t ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  struct uring_file files[URING_BATCH];
+  int file_count;
+  int no_fallocate;
+};
+
+static int uring_supports(int fd) {
+  static const int needed[] = { IORING_OP_OPENAT, IORING_OP_FALLOCATE, IORING_OP_WRITE, IORING_OP_CLOSE,
+      IORING_OP_RENAMEAT };
+  size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, size);
+  size_t i;
+  int ok = 0;
+  
+  if (probe && syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+    ok = 1;
+    for (i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+      if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+        ok = 0;
+      }
+    }
+  }
+  free(probe);
+  return ok;
+}
+
+/* Sets up a ring, or returns NULL when the kernel lacks what the chains need */
+struct uring *uring_start(void) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  
+  // Room for a full batch of the longest chain: openat, fallocate, write, close, renameat
+  int fd = (int)syscall(__NR_io_uring_setup, URING_BATCH * URING_FILE_SQES, &params);
+  if (fd < 0) return NULL;
+  
+  // Chains use a descriptor opened earlier in the same link, which needs 5.17
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_LINKED_FILE) ||
+      !uring_supports(fd)) {
+    close(fd);
+    return NULL;
+  }
+  
+  struct uring *ring = calloc(1, sizeof(*ring));
+  if (!ring) {
+    close(fd);
+    return NULL;
+  }
+  ring->fd = fd;
+  
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      fd, IORING_OFF_SQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      fd, IORING_OFF_SQES);
+  
+  int slots[URING_BATCH];
+  int i;
+  for (i = 0; i < URING_BATCH; i++) {
+    slots[i] = -1;
+  }
+  if (ring->ring == MAP_FAILED || ring->sqes == MAP_FAILED ||
+      syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, slots, URING_BATCH) != 0) {
+    if (ring->ring != MAP_FAILED) munmap(ring->ring, ring->ring_size);
+    if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    close(fd);
+    free(ring);
+    return NULL;
+  }
+  
+  char *base = ring->ring;
+  ring->sq_head = (unsigned *)(base + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(base + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(base + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(base + params.sq_off.array);
+  ring->cq_head = (unsigned *)(base + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(base + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(base + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+  return ring;
+}
+
+static struct io_uring_sqe *uring_next_sqe(struct uring *ring, unsigned *tail, __u64 user_data,
+    __u8 opcode, __u8 flags) {
+  unsigned index = *tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->flags = flags;
+  sqe->user_data = user_data;
+  ring->sq_array[index] = index;
+  (*tail)++;
+  return sqe;
+}
+
+/* Submits every queued chain, waits for all of them and reports the files */
+static void uring_flush(struct uring *ring) {
+  if (ring->file_count == 0) return;
+  
+  double start = stat_clock();
+  unsigned tail = *ring->sq_tail;
+  unsigned queued = 0;
+  int i;
+  
+  for (i = 0; i < ring->file_count; i++) {
+    struct uring_file *file = &ring->files[i];
+    int atomic = file->out->atomic;
+    __u64 id = (__u64)i;
+    struct io_uring_sqe *sqe;
+    
+    sqe = uring_next_sqe(ring, &tail, id, IORING_OP_OPENAT, IOSQE_IO_LINK);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (__u64)(uintptr_t)(atomic ? file->temp_path : file->full_path);
+    sqe->len = 0666;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqe->file_index = (__u32)i + 1;
+    
+    // Tagged, so a filesystem without fallocate switches it off for later batches
+    if (file->size >= PREALLOCATE_MIN && !ring->no_fallocate) {
+      sqe = uring_next_sqe(ring, &tail, id | URING_FALLOCATE_TAG, IORING_OP_FALLOCATE,
+          IOSQE_FIXED_FILE | IOSQE_IO_LINK);
+      sqe->fd = i;
+      sqe->off = 0;
+      sqe->addr = (__u64)file->size;
+      queued++;
+    }
+    
+    sqe = uring_next_sqe(ring, &tail, id | URING_WRITE_TAG, IORING_OP_WRITE, IOSQE_FIXED_FILE | IOSQE_IO_LINK);
+    sqe->fd = i;
+    sqe->addr = (__u64)(uintptr_t)file->data;
+    sqe->len = (__u32)file->size;
+    sqe->off = 0;
+    
+    sqe = uring_next_sqe(ring, &tail, id, IORING_OP_CLOSE, atomic ? IOSQE_IO_LINK : 0);
+    sqe->file_index = (__u32)i + 1;
+    queued += 3;
+    
+    if (atomic) {
+      sqe = uring_next_sqe(ring, &tail, id | URING_RENAME_TAG, IORING_OP_RENAMEAT, 0);
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (__u64)(uintptr_t)file->temp_path;
+      sqe->len = (__u32)AT_FDCWD;
+      sqe->addr2 = (__u64)(uintptr_t)file->full_path;
+      queued++;
+    }
+  }
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+  
+  // Every step is checked: an error, a cancellation, a short write or a failed rename marks the file
+  unsigned submitted = 0;
+  unsigned completed = 0;
+  while (completed < queued) {
+    int n = (int)syscall(__NR_io_uring_enter, ring->fd, queued - submitted, queued - completed,
+        IORING_ENTER_GETEVENTS, NULL, 0);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    submitted += (unsigned)n;
+    
+    unsigned head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      __u64 file_id = cqe->user_data & ~URING_STEP_TAGS;
+      if (file_id < (__u64)ring->file_count) {
+        struct uring_file *file = &ring->files[file_id];
+        int short_write = (cqe->user_data & URING_WRITE_TAG) && cqe->res >= 0 &&
+            (size_t)cqe->res != file->size;
+        if (cqe->res < 0 || short_write) file->failed = 1;
+        if ((cqe->user_data & URING_FALLOCATE_TAG) && (cqe->res == -EOPNOTSUPP || cqe->res == -EINVAL)) {
+          ring->no_fallocate = 1;
+        }
+      }
+      head++;
+      completed++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+  stat_time(STATS.write_ns, start);
+  
+  for (i = 0; i < ring->file_count; i++) {
+    struct uring_file *file = &ring->files[i];
+    if (file->failed || completed < queued) {
+      // The chain may have got as far as opening, or writing, its temporary file
+      if (file->out->atomic) remove_output(file->temp_path);
+      write_file_block(file->out, file->path, file->data, file->size);
+    } else {
+      report_file(file->out, "Created", file->path);
+      count_write(file->out->totals, WRITE_CREATED);
+    }
+  }
+  ring->file_count = 0;
+}
+
+/* Queues one file; -1 means it has to be written synchronously instead */
+int uring_write_file(struct uring *ring, const struct output *out, const char *path,
+    const char *data, size_t size) {
+  // write_file_block() reports a path that is too long
+  if (size > URING_MAX_WRITE || strlen(out->root) + strlen(path) + 1 >= MAX_PATH_LENGTH) return -1;
+  
+  // A path already in this batch must land after it, as in a sequential run
+  int i;
+  for (i = 0; i < ring->file_count; i++) {
+    if (strcmp(ring->files[i].path, path) == 0) {
+      uring_flush(ring);
+      break;
+    }
+  }
+  if (ring->file_count == URING_BATCH) {
+    uring_flush(ring);
+  }
+  
+  struct uring_file *file = &ring->files[ring->file_count++];
+  file->out = out;
+  snprintf(file->path, sizeof(file->path), "%s", path);
+  snprintf(file->full_path, sizeof(file->full_path), "%s/%s", out->root, path);
+  temp_path_for(file->temp_path, sizeof(file->temp_path), out->root, path);
+  file->data = data;
+  file->size = size;
+  file->failed = 0;
+  stat_add(STATS.opens, 1);
+  stat_add(STATS.writes, 1);
+  stat_add(STATS.bytes_written, size);
+  return 0;
+}
+
+/* Writes out what is still queued and tears the ring down */
+void uring_finish(struct uring *ring) {
+  if (!ring) return;
+  uring_flush(ring);
+  munmap(ring->sqes, ring->sqes_size);
+  munmap(ring->ring, ring->ring_size);
+  close(ring->fd);
+  free(ring);
+}
+#endif
+
+#ifdef AI2FS_OVERLAPPED
+/*
+ * Overlapped output for the sequential path on Windows. A batch of up to
+ * OVERLAPPED_BATCH files is opened with CreateFileW, and every write is
+ * issued before the first one is waited on, so the writes overlap instead
+ * of going out one file at a time. Handles are closed, and renamed into
+ * place with --atomic, once the whole batch has landed. Overlapped handles
+ * bypass the CRT, so the "\n" to "\r\n" translation of text mode is done
+ * here, on a copy of any content that has newlines. Any file that fails on
+ * the way is rewritten through write_file_block(), which also reports the
+ * error.
+ */
+struct overlapped_file {
+  const struct output *out;
+  char path[MAX_PATH_LENGTH];
+  char full_path[MAX_PATH_LENGTH];
+  char temp_path[TEMP_PATH_LENGTH];
+  const char *data;
+  size_t size;
+  char *text;
+  DWORD length;
+  HANDLE handle;
+  OVERLAPPED overlapped;
+  int pending;
+  int failed;
+};
+
+struct overlapped_batch {
+  struct overlapped_file files[OVERLAPPED_BATCH];
+  int file_count;
+};
+
+struct overlapped_batch *overlapped_start(void) {
+  return calloc(1, sizeof(struct overlapped_batch));
+}
+
+/* The bytes text mode would have written for data; NULL if it has no newline */
+static char *text_mode_copy(const char *data, size_t size, size_t *length) {
+  size_t newlines = 0;
+  const char *p = data;
+  const char *end = data + size;
+  while ((p = memchr(p, '\n', end - p)) != NULL) {
+    newlines++;
+    p++;
+  }
+  *length = size + newlines;
+  if (newlines == 0) return NULL;
+  
+  char *text = malloc(*length);
+  if (!text) return NULL;
+  char *q = text;
+  for (p = data; p < end; p++) {
+    if (*p == '\n') *q++ = '\r';
+    *q++ = *p;
+  }
+  return text;
+}
+
+/* Opens a file and issues its write; the file ends up pending or failed */
+static void overlapped_issue(struct overlapped_file *file) {
+  wchar_t wide[TEMP_PATH_LENGTH];
+  const char *target = file->out->atomic ? file->temp_path : file->full_path;
+  
+  if (wide_path(target, wide, TEMP_PATH_LENGTH) != 0) {
+    file->failed = 1;
+    return;
+  }
+  file->handle = CreateFileW(wide, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+      CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_OVERLAPPED, NULL);
+  if (file->handle == INVALID_HANDLE_VALUE) {
+    file->failed = 1;
+    return;
+  }
+  
+  size_t length;
+  file->text = text_mode_copy(file->data, file->size, &length);
+  if (!file->text && length != file->size) {
+    file->failed = 1;
+    return;
+  }
+  file->length = (DWORD)length;
+  if (length >= PREALLOCATE_MIN) {
+    FILE_ALLOCATION_INFO info;
+    info.AllocationSize.QuadPart = (LONGLONG)length;
+    SetFileInformationByHandle(file->handle, FileAllocationInfo, &info, sizeof(info));
+  }
+  
+  // A write that completes at once still posts its result to the OVERLAPPED
+  memset(&file->overlapped, 0, sizeof(file->overlapped));
+  if (WriteFile(file->handle, file->text ? file->text : file->data, file->length, NULL,
+      &file->overlapped) || GetLastError() == ERROR_IO_PENDING) {
+    file->pending = 1;
+  } else {
+    file->failed = 1;
+  }
+}
+
+/* Issues every queued write, waits for all of them and reports the files */
+static void overlapped_flush(struct overlapped_batch *batch) {
+  if (batch->file_count == 0) return;
+  
+  double start = stat_clock();
+  int i;
+  for (i = 0; i < batch->file_count; i++) {
+    overlapped_issue(&batch->files[i]);
+  }
+  
+  for (i = 0; i < batch->file_count; i++) {
+    struct overlapped_file *file = &batch->files[i];
+    DWORD written = 0;
+    if (file->pending && (!GetOverlappedResult(file->handle, &file->overlapped, &written, TRUE) ||
+        written != file->length)) {
+      file->failed = 1;
+    }
+    if (file->handle != INVALID_HANDLE_VALUE && !CloseHandle(file->handle)) {
+      file->failed = 1;
+    }
+    if (file->out->atomic && file->handle != INVALID_HANDLE_VALUE) {
+      if (!file->failed && replace_file(file->temp_path, file->full_path) != 0) {
+        file->failed = 1;
+      }
+      if (file->failed) remove_output(file->temp_path);
+    }
+    free(file->text);
+    file->text = NULL;
+  }
+  stat_time(STATS.write_ns, start);
+  
+  for (i = 0; i < batch->file_count; i++) {
+    struct overlapped_file *file = &batch->files[i];
+    if (file->failed) {
+      write_file_block(file->out, file->path, file->data, file->size);
+    } else {
+      report_file(file->out, "Created", file->path);
+      count_write(file->out->totals, WRITE_CREATED);
+    }
+  }
+  batch->file_count = 0;
+}
+
+/* Queues one file; -1 means it has to be written synchronously instead */
+int overlapped_write_file(struct overlapped_batch *batch, const struct output *out, const char *path,
+    const char *data, size_t size) {
+  // write_file_block() reports a path that is too long
+  if (size > OVERLAPPED_MAX_WRITE || strlen(out->root) + strlen(path) + 1 >= MAX_PATH_LENGTH) return -1;
+  
+  // A path already in this batch must land after it, as in a sequential run
+  int i;
+  for (i = 0; i < batch->file_count; i++) {
+    if (strcmp(batch->files[i].path, path) == 0) {
+      overlapped_flush(batch);
+      break;
+    }
+  }
+  if (batch->file_count == OVERLAPPED_BATCH) {
+    overlapped_flush(batch);
+  }
+  
+  struct overlapped_file *file = &batch->files[batch->file_count++];
+  file->out = out;
+  snprintf(file->path, sizeof(file->path), "%s", path);
+  snprintf(file->full_path, sizeof(file->full_path), "%s/%s", out->root, path);
+  temp_path_for(file->temp_path, sizeof(file->temp_path), out->root, path);
+  file->data = data;
+  file->size = size;
+  file->text = NULL;
+  file->handle = INVALID_HANDLE_VALUE;
+  file->pending = 0;
+  file->failed = 0;
+  stat_add(STATS.opens, 1);
+  stat_add(STATS.writes, 1);
+  stat_add(STATS.bytes_written, size);
+  return 0;
+}
+
+/* Writes out what is still queued and frees the batch */
+void overlapped_finish(struct overlapped_batch *batch) {
+  if (!batch) return;
+  overlapped_flush(batch);
+  free(batch);
+}
+#endif
+
+/* Adds a parser's line and marker counts; the parser keeps them so its loop is free of atomics */
+static void count_parse(const struct ai2fs_counts *counts) {
+  size_t i;
+  
+  stat_add(STATS.lines, counts->lines);
+  for (i = 0; i < ai2fs_marker_count(MARKERS); i++) {
+    stat_add(STATS.marker_lines[i], counts->markers[i]);
+  }
+  (void)counts;
+}
+
+/*
+ * The file being written while streaming; fd is -1 when its content is
+ * dropped. seen holds the paths written so far when the first block wins.
+ * published is how much of an --atomic file --watch has already put in
+ * place, 0 while full_path is untouched; spare_path, when set, is the
+ * second copy stream_publish() alternates with, spare_size bytes long,
+ * and copy_only is set once hard links turn out not to work there.
+ */
+struct stream_file {
+  const struct output *out;
+  struct dir_cache *seen;
+  char path[MAX_PATH_LENGTH];
+  char full_path[MAX_PATH_LENGTH];
+  char temp_path[TEMP_PATH_LENGTH];
+  char spare_path[TEMP_PATH_LENGTH];
+  int fd;
+  unsigned long long written;
+  unsigned long long published;
+  unsigned long long spare_size;
+  int copy_only;
+};
+
+/*
+ * Opens the output for a path found while streaming. With --atomic,
+ * temp_path receives the name it is written under.
+ */
+static int stream_begin(void *context, const char *path, int marker) {
+  struct stream_file *file = context;
+  const struct output *out = file->out;
+  
+  (void)marker;
+  file->fd = -1;
+  file->written = 0;
+  file->published = 0;
+  file->spare_path[0] = '\0';
+  file->spare_size = 0;
+  if (!path_selected(out->filter, path)) {
+    stat_add(STATS.filtered, 1);
+    return 0;
+  }
+  if (file->seen) {
+    size_t len = strlen(path);
+    if (dir_cache_contains(file->seen, path, len)) {
+      stat_add(STATS.repeated, 1);
+      return 0;
+    }
+    if (dir_cache_insert(file->seen, path, len) != 0) return -1;
+  }
+  memcpy(file->path, path, strlen(path) + 1);
+  if (output_path(file->full_path, sizeof(file->full_path), out->root, path) != 0 ||
+      (out->atomic && temp_path_for(file->temp_path, sizeof(file->temp_path), out->root, path) != 0)) {
+    report_too_long(out, path);
+    return 0;
+  }
+  create_directories(out->dirs, out->root, path);
+  file->fd = open_output(out->atomic ? file->temp_path : file->full_path);
+  if (file->fd < 0) {
+    fprintf(stderr, "Error creating file %s: %s\n", 
+        file->full_path, strerror(errno));
+    count_write(out->totals, WRITE_FAILED);
+  }
+  return 0;
+}
+
+/* Removes what a failed file left behind, published copies included, and counts it */
+static void stream_drop(struct stream_file *file) {
+  const struct output *out = file->out;
+  
+  remove_output(out->atomic ? file->temp_path : file->full_path);
+  if (file->published) remove_output(file->full_path);
+  if (file->spare_path[0]) remove_output(file->spare_path);
+  file->spare_path[0] = '\0';
+  count_write(out->totals, WRITE_FAILED);
+}
+
+/* Writes content as it arrives; a file that grows past --max-file-size is dropped */
+static int stream_data(void *context, const char *data, size_t len) {
+  struct stream_file *file = context;
+  const struct output *out = file->out;
+  
+  if (file->fd < 0) return 0;
+  file->written += len;
+  if (out->max_file_size && file->written > out->max_file_size) {
+    fprintf(stderr, "Error writing file %s: larger than --max-file-size\n", file->full_path);
+    close_output(file->fd);
+    file->fd = -1;
+    stream_drop(file);
+    return 0;
+  }
+  if (write_output(file->fd, data, len) != 0) {
+    fprintf(stderr, "Error writing file %s: %s\n", file->full_path, strerror(errno));
+    close_output(file->fd);
+    file->fd = -1;
+    stream_drop(file);
+  }
+  return 0;
+}
+
+static int stream_end(void *context) {
+  struct stream_file *file = context;
+  
+  if (file->fd < 0) return 0;
+  int status = close_output(file->fd);
+  file->fd = -1;
+  if (status != 0) {
+    fprintf(stderr, "Error writing file %s: %s\n", file->full_path, strerror(errno));
+    stream_drop(file);
+    return 0;
+  }
+  
+  if (file->spare_path[0]) remove_output(file->spare_path);
+  file->spare_path[0] = '\0';
+  if (commit_output(file->out, file->temp_path, file->full_path) != 0) return 0;
+  report_file(file->out, "Created", file->path);
+  count_write(file->out->totals, WRITE_CREATED);
+  return 0;
+}
+
+/* One read from stdin; -1 with errno set on error, 0 at its end */
+static long read_stdin(char *buffer, size_t size) {
+  for (;;) {
+    #ifdef _WIN32
+      int n = _read(_fileno(stdin), buffer, (unsigned)size);
+    #else
+      ssize_t n = read(STDIN_FILENO, buffer, size);
+    #endif
+    if (n < 0 && errno == EINTR) continue;
+    return (long)n;
+  }
+}
+
+/*
+ * Parses stdin as it arrives. Content is written to the current file as
+ * soon as it is read, and progress messages are flushed after every read,
+ * so files fill in while the producer is still running. The push parser
+ * holds only a line that may be a marker until its newline shows up, so
+ * memory stays at STREAM_BUFFER_SIZE unless a marker candidate is longer.
+ * A later block cannot be known in advance, so every block of a repeated
+ * path is written unless the first one wins. A gzip or zstd stream is
+ * unpacked on the way in and parsed the same way, by process_rest().
+ */
+int process_stream(const struct output *out) {
+  static const struct ai2fs_callbacks callbacks = { stream_begin, stream_data, stream_end };
+  struct dir_cache seen = {0};
+  struct stream_file file = { out, out->first_wins ? &seen : NULL, {0}, {0}, {0}, {0}, -1, 0, 0, 0, 0 };
+  char *buffer = malloc(STREAM_BUFFER_SIZE);
+  ai2fs_parser *parser = NULL;
+  int status = 1;
+  
+  if (!buffer) {
+    perror("Memory allocation failed");
+    return 1;
+  }
+  
+  // The first bytes tell a compressed stream from text
+  size_t len = 0;
+  long n = 1;
+  while (len < 4 && (n = read_stdin(buffer + len, STREAM_BUFFER_SIZE - len)) > 0) {
+    len += (size_t)n;
+  }
+  if (n < 0) {
+    perror("Error reading input");
+    free(buffer);
+    return 1;
+  }
+  const char *tool = input_decompressor(buffer, len);
+  if (tool) {
+    #ifdef _WIN32
+      // Without fork there is no feeder to hand the tool the bytes already read
+      fprintf(stderr, "%s: a compressed stdin cannot be unpacked on Windows; pass its file name instead\n",
+          PROGRAM_NAME);
+    #else
+      struct input_buffer input = {0};
+      input.data = buffer;
+      input.size = len;
+      input.stream = 1;
+      input.rest = stdin;
+      stat_add(STATS.bytes_read, len);
+      status = decompress_input("stdin", tool, &input) == 0 ? process_rest("stdin", &input, out) : 1;
+      release_input(&input);
+    #endif
+    free(buffer);
+    return status;
+  }
+  
+  parser = ai2fs_parser_new(MARKERS, &callbacks, &file);
+  if (!parser) {
+    perror("Memory allocation failed");
+    free(buffer);
+    return 1;
+  }
+  for (;;) {
+    if (len > 0) {
+      stat_add(STATS.bytes_read, len);
+      if (ai2fs_parser_feed(parser, buffer, len) != 0) {
+        perror("Memory allocation failed");
+        break;
+      }
+      log_flush(out->log);
+    }
+    if (n == 0) {
+      status = 0;
+      break;
+    }
+    n = read_stdin(buffer, STREAM_BUFFER_SIZE);
+    if (n < 0) {
+      perror("Error reading input");
+      break;
+    }
+    len = (size_t)n;
+  }
+  
+  // The parser ends the last file; after a failed feed it is closed here
+  ai2fs_parser_finish(parser);
+  if (file.fd >= 0) stream_end(&file);
+  
+  count_parse(ai2fs_parser_counts(parser));
+  stat_max(STATS.peak_buffer, STREAM_BUFFER_SIZE + ai2fs_parser_counts(parser)->held_capacity);
+  
+  ai2fs_parser_free(parser);
+  free_dir_cache(&seen);
+  free(buffer);
+  return status;
+}
+
+/*
+ * Set by SIGINT or SIGTERM in --serve and --watch, which then wind down.
+ * A loop that sleeps in poll() also watches STOP_PIPE, the read end of a
+ * pipe the handler writes to, so a signal that lands between its check of
+ * STOP_REQUESTED and the poll() still wakes it.
+ */
+static volatile sig_atomic_t STOP_REQUESTED;
+#ifndef _WIN32
+  static int STOP_PIPE[2] = { -1, -1 };
+#endif
+
+static void request_stop(int signal_number) {
+  (void)signal_number;
+  STOP_REQUESTED = 1;
+  #ifndef _WIN32
+    if (STOP_PIPE[1] >= 0) {
+      int saved = errno;
+      ssize_t ignored = write(STOP_PIPE[1], "", 1);
+      (void)ignored;
+      errno = saved;
+    }
+  #endif
+}
+
+#ifndef _WIN32
+/* Opens STOP_PIPE before the handlers are installed; without it a late signal waits for the next event */
+static void open_stop_pipe(void) {
+  if (open_pipe(STOP_PIPE) != 0) {
+    STOP_PIPE[0] = STOP_PIPE[1] = -1;
+    return;
+  }
+  int i;
+  for (i = 0; i < 2; i++) {
+    fcntl(STOP_PIPE[i], F_SETFL, fcntl(STOP_PIPE[i], F_GETFL) | O_NONBLOCK);
+  }
+}
+
+static void close_stop_pipe(void) {
+  int i;
+  for (i = 0; i < 2; i++) {
+    if (STOP_PIPE[i] >= 0) close(STOP_PIPE[i]);
+    STOP_PIPE[i] = -1;
+  }
+}
+#endif
+
+/* --watch: the transcript as far as it has been parsed */
+struct watch_input {
+  const char *filename;
+  const char *name;
+  int fd;
+  unsigned long long inode;
+  unsigned long long offset;
+};
+
+/*
+ * Parses whatever was appended to the transcript since the last call. If
+ * it was replaced or truncated, the parse starts over from byte 0; a
+ * missing transcript is waited for.
+ */
+static int watch_catch_up(struct watch_input *input, ai2fs_parser *parser,
+    struct stream_file *file, char *buffer) {
+  struct stat st;
+  
+  if (stat(input->filename, &st) != 0) return 0;
+  if (input->fd >= 0 && ((unsigned long long)st.st_ino != input->inode ||
+      (unsigned long long)st.st_size < input->offset)) {
+    ai2fs_parser_finish(parser);
+    if (file->fd >= 0) stream_end(file);
+    if (file->seen) free_dir_cache(file->seen);
+    #ifdef _WIN32
+      _close(input->fd);
+    #else
+      close(input->fd);
+    #endif
+    input->fd = -1;
+    if (!file->out->quiet) {
+      log_message(file->out->log, "Input '", input->filename, "' replaced, parsing it again.");
+    }
+  }
+  
+  if (input->fd < 0) {
+    #ifdef _WIN32
+      input->fd = _open(input->filename, _O_RDONLY | _O_BINARY);
+    #else
+      input->fd = open(input->filename, O_RDONLY);
+    #endif
+    if (input->fd < 0 || fstat(input->fd, &st) != 0) return 0;
+    input->inode = (unsigned long long)st.st_ino;
+    input->offset = 0;
+  }
+  
+  for (;;) {
+    #ifdef _WIN32
+      int n = _read(input->fd, buffer, STREAM_BUFFER_SIZE);
+    #else
+      ssize_t n = read(input->fd, buffer, STREAM_BUFFER_SIZE);
+      if (n < 0 && errno == EINTR) continue;
+    #endif
+    if (n < 0) {
+      perror("Error reading input");
+      return -1;
+    }
+    if (n == 0) break;
+    // A compressed transcript is only whole once its writer is done with it
+    if (input->offset == 0 && input_decompressor(buffer, (size_t)n)) {
+      fprintf(stderr, "%s: --watch follows plain text; %s is compressed\n", PROGRAM_NAME, input->filename);
+      return -1;
+    }
+    stat_add(STATS.bytes_read, (size_t)n);
+    input->offset += (unsigned long long)n;
+    if (ai2fs_parser_feed(parser, buffer, (size_t)n) != 0) {
+      perror("Memory allocation failed");
+      return -1;
+    }
+  }
+  log_flush(file->out->log);
+  return 0;
+}
+
+#ifndef _WIN32
+/*
+ * Publishes by hard-linking the temporary file over the target. It is not
+ * written again: writing moves to the spare copy, which is brought level
+ * first. The spare was itself published one pass earlier, so only that
+ * pass's bytes are copied. -1 if the file system has no hard links, before
+ * anything changed; a failure after the link drops the file.
+ */
+static int stream_swap(struct stream_file *file, char *buffer) {
+  const struct output *out = file->out;
+  char link_path[TEMP_PATH_LENGTH];
+  
+  if (temp_path_for(link_path, sizeof(link_path), out->root, file->path) != 0 ||
+      link(file->temp_path, link_path) != 0) {
+    return -1;
+  }
+  if (replace_file(link_path, file->full_path) != 0) {
+    remove_output(link_path);
+    return -1;
+  }
+  file->published = file->written;
+  
+  int fresh = !file->spare_path[0];
+  if (fresh && temp_path_for(file->spare_path, sizeof(file->spare_path), out->root, file->path) != 0) {
+    file->spare_path[0] = '\0';
+  }
+  if (fresh) file->spare_size = 0;
+  int spare = !file->spare_path[0] ? -1 :
+      fresh ? open_output(file->spare_path) : open(file->spare_path, O_WRONLY);
+  int source = open(file->temp_path, O_RDONLY);
+  int failed = spare < 0 || source < 0 ||
+      lseek(source, (off_t)file->spare_size, SEEK_SET) < 0 ||
+      lseek(spare, (off_t)file->spare_size, SEEK_SET) < 0;
+  while (!failed) {
+    ssize_t n = read(source, buffer, STREAM_BUFFER_SIZE);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      failed = n < 0;
+      break;
+    }
+    failed = write_output(spare, buffer, (size_t)n) != 0;
+  }
+  int error = errno;
+  if (source >= 0) close(source);
+  if (close_output(file->fd) != 0 && !failed) {
+    failed = 1;
+    error = errno;
+  }
+  file->fd = spare;
+  
+  // The published copy keeps its temporary name as the next spare
+  char published[TEMP_PATH_LENGTH];
+  memcpy(published, file->temp_path, sizeof(published));
+  memcpy(file->temp_path, file->spare_path, sizeof(file->temp_path));
+  memcpy(file->spare_path, published, sizeof(file->spare_path));
+  file->spare_size = file->written;
+  if (failed) {
+    // The target cannot be written in place, so there is nowhere left to grow
+    fprintf(stderr, "Error writing file %s: %s\n", file->full_path, strerror(error));
+    if (file->fd >= 0) close_output(file->fd);
+    file->fd = -1;
+    if (!file->temp_path[0]) memcpy(file->temp_path, file->spare_path, sizeof(file->temp_path));
+    stream_drop(file);
+  }
+  return 0;
+}
+#endif
+
+/*
+ * --watch --atomic: puts what the last file holds so far in place, so it
+ * is not hidden until the next path line, and the target only ever shows
+ * whole passes. stream_swap() does it for the cost of the new bytes.
+ * Without hard links (and on Windows) the whole temporary file is copied
+ * under a second name and renamed over the target instead, so each pass
+ * then costs as much as the file.
+ */
+static void stream_publish(struct stream_file *file, char *buffer) {
+  const struct output *out = file->out;
+  char snapshot[TEMP_PATH_LENGTH];
+  
+  if (!out->atomic || file->fd < 0 || file->written == file->published) return;
+  #ifndef _WIN32
+    if (!file->copy_only) {
+      if (stream_swap(file, buffer) == 0) return;
+      file->copy_only = 1;
+    }
+  #endif
+  #ifdef _WIN32
+    // Read back as text, so the copy is translated the same way once more
+    int source = _open(file->temp_path, _O_RDONLY | _O_TEXT);
+  #else
+    int source = open(file->temp_path, O_RDONLY);
+  #endif
+  if (source < 0) return;
+  int copy = temp_path_for(snapshot, sizeof(snapshot), out->root, file->path) == 0 ?
+      open_output(snapshot) : -1;
+  int failed = copy < 0;
+  while (!failed) {
+    #ifdef _WIN32
+      int n = _read(source, buffer, STREAM_BUFFER_SIZE);
+    #else
+      ssize_t n = read(source, buffer, STREAM_BUFFER_SIZE);
+      if (n < 0 && errno == EINTR) continue;
+    #endif
+    if (n <= 0) {
+      failed = n < 0;
+      break;
+    }
+    failed = write_output(copy, buffer, (size_t)n) != 0;
+  }
+  #ifdef _WIN32
+    _close(source);
+  #else
+    close(source);
+  #endif
+  if (copy >= 0 && close_output(copy) != 0) failed = 1;
+  if (!failed && replace_file(snapshot, file->full_path) == 0) {
+    file->published = file->written;
+    return;
+  }
+  // The file still appears whole when it ends; only this pass is skipped
+  fprintf(stderr, "Error updating file %s: %s\n", file->full_path, strerror(errno));
+  if (copy >= 0) remove_output(snapshot);
+}
+
+/*
+ * Blocks until the transcript may have changed or a stop is requested.
+ * On Linux the directory holding it is watched, which also sees it being
+ * replaced; elsewhere it is polled every WATCH_POLL_MS. STOP_PIPE cuts
+ * either wait short.
+ */
+static void watch_wait(int notify, const char *name) {
+  #ifdef __linux__
+    if (notify >= 0) {
+      char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+      while (!STOP_REQUESTED) {
+        struct pollfd ready[2] = { { notify, POLLIN, 0 }, { STOP_PIPE[0], POLLIN, 0 } };
+        if (poll(ready, STOP_PIPE[0] >= 0 ? 2 : 1, -1) < 0 && errno != EINTR) return;
+        if (!(ready[0].revents & POLLIN)) continue;
+        ssize_t n = read(notify, events, sizeof(events));
+        if (n <= 0) return;
+        
+        ssize_t at = 0;
+        while (at < n) {
+          const struct inotify_event *event = (const struct inotify_event *)(events + at);
+          if ((event->mask & IN_Q_OVERFLOW) ||
+              (event->len > 0 && strcmp(event->name, name) == 0)) {
+            return;
+          }
+          at += (ssize_t)(sizeof(*event) + event->len);
+        }
+      }
+      return;
+    }
+  #endif
+  (void)notify;
+  (void)name;
+  #ifdef _WIN32
+    Sleep(WATCH_POLL_MS);
+  #else
+    struct pollfd ready = { STOP_PIPE[0], POLLIN, 0 };
+    poll(&ready, STOP_PIPE[0] >= 0 ? 1 : 0, WATCH_POLL_MS);
+  #endif
+}
+
+/*
+ * --watch: parses the transcript like "-" does stdin, then keeps the push
+ * parser and the open file across changes and parses only what was
+ * appended. Files already complete are left alone; the last one grows in
+ * place. Runs until SIGINT or SIGTERM, which ends the last file.
+ */
+int process_watch(const char *filename, const struct output *out) {
+  static const struct ai2fs_callbacks callbacks = { stream_begin, stream_data, stream_end };
+  struct dir_cache seen = {0};
+  struct stream_file file = { out, out->first_wins ? &seen : NULL, {0}, {0}, {0}, {0}, -1, 0, 0, 0, 0 };
+  struct watch_input input = { filename, filename, -1, 0, 0 };
+  char *buffer = malloc(STREAM_BUFFER_SIZE);
+  ai2fs_parser *parser = ai2fs_parser_new(MARKERS, &callbacks, &file);
+  int notify = -1;
+  int status = 0;
+  const char *p;
+  
+  if (!buffer || !parser) {
+    perror("Memory allocation failed");
+    free(buffer);
+    ai2fs_parser_free(parser);
+    return 1;
+  }
+  for (p = filename; *p; p++) {
+    if (*p == '/' || *p == '\\') input.name = p + 1;
+  }
+  
+  #ifdef __linux__
+    char dir[MAX_PATH_LENGTH * 4];
+    size_t dir_len = (size_t)(input.name - filename);
+    if (dir_len == 0) {
+      memcpy(dir, ".", 2);
+    } else if (dir_len < sizeof(dir)) {
+      memcpy(dir, filename, dir_len);
+      dir[dir_len] = '\0';
+    }
+    notify = inotify_init1(IN_CLOEXEC);
+    if (notify >= 0 && (dir_len >= sizeof(dir) || inotify_add_watch(notify, dir,
+        IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO | IN_ATTRIB) < 0)) {
+      close(notify);
+      notify = -1;
+    }
+  #endif
+  
+  // Without SA_RESTART the signal also cuts the wait short
+  #ifdef _WIN32
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
+  #else
+    open_stop_pipe();
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+  #endif
+  
+  if (!out->quiet) log_message(out->log, "Watching '", filename, "'.");
+  while (!STOP_REQUESTED) {
+    if (watch_catch_up(&input, parser, &file, buffer) != 0) {
+      status = 1;
+      break;
+    }
+    if (STOP_REQUESTED) break;
+    stream_publish(&file, buffer);
+    watch_wait(notify, input.name);
+  }
+  
+  ai2fs_parser_finish(parser);
+  if (file.fd >= 0) stream_end(&file);
+  count_parse(ai2fs_parser_counts(parser));
+  stat_max(STATS.peak_buffer, STREAM_BUFFER_SIZE + ai2fs_parser_counts(parser)->held_capacity);
+  
+  #ifdef _WIN32
+    if (input.fd >= 0) _close(input.fd);
+  #else
+    if (input.fd >= 0) close(input.fd);
+    if (notify >= 0) close(notify);
+    close_stop_pipe();
+  #endif
+  ai2fs_parser_free(parser);
+  free_dir_cache(&seen);
+  free(buffer);
+  return status;
+}
+
+/*
+ * Makes room to read more into the heap buffer, doubling it when full.
+ * Past the buffer's limit it fails with EFBIG, and the caller leaves the
+ * rest of the input for process_rest().
+ */
+static int input_reserve(struct input_buffer *input) {
+  if (input->size < input->capacity) return 0;
+  if (input->limit && input->capacity >= input->limit) {
+    errno = EFBIG;
+    return -1;
+  }
+  
+  size_t capacity = input->capacity ? input->capacity * 2 : READ_CHUNK_SIZE;
+  if (input->limit && capacity > input->limit) capacity = input->limit;
+  char *new_buffer = realloc(input->buffer, capacity);
+  if (!new_buffer) {
+    errno = ENOMEM;
+    return -1;
+  }
+  input->buffer = new_buffer;
+  input->capacity = capacity;
+  input->data = new_buffer;
+  stat_max(STATS.peak_buffer, capacity);
+  return 0;
+}
+
+/* The tool that unpacks an input, from its magic number; NULL for plain text */
+const char *input_decompressor(const char *data, size_t size) {
+  static const char gzip_magic[] = "\x1f\x8b";
+  static const char zstd_magic[] = "\x28\xb5\x2f\xfd";
+  
+  if (size >= 4 && memcmp(data, zstd_magic, 4) == 0) return "zstd";
+  if (size >= 2 && memcmp(data, gzip_magic, 2) == 0) return "gzip";
+  return NULL;
+}
+
+#ifndef _WIN32
+/* Reaps a decompressor and its feeder; only the tool's status counts, as the feeder fails when it gives up */
+static int wait_decompressor(pid_t child, pid_t feeder) {
+  int status = 0;
+  
+  if (feeder > 0) {
+    while (waitpid(feeder, &status, 0) < 0 && errno == EINTR) {
+    }
+  }
+  if (child > 0) {
+    while (waitpid(child, &status, 0) < 0 && errno == EINTR) {
+    }
+  }
+  return child > 0 && feeder > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+#endif
+
+/* Reaps the decompressor behind an input; -1 unless it unpacked everything */
+static int end_decompressor(struct input_buffer *input) {
+  int failed = 0;
+  
+  input->tool = NULL;
+  #ifdef _WIN32
+    if (input->process && wait_tool(input->process) != 0) failed = 1;
+    input->process = NULL;
+  #else
+    if (input->child > 0 && wait_decompressor(input->child, input->feeder) != 0) failed = 1;
+    input->child = 0;
+    input->feeder = 0;
+  #endif
+  return failed ? -1 : 0;
+}
+
+/* Closes the remainder of an input, and reaps its decompressor; -1 if reading it failed */
+static int close_rest(struct input_buffer *input) {
+  if (!input->rest) return 0;
+  
+  int failed = ferror(input->rest);
+  fclose(input->rest);
+  input->rest = NULL;
+  if (end_decompressor(input) != 0) failed = 1;
+  return failed ? -1 : 0;
+}
+
+/*
+ * Starts tool (which must be on the PATH) on a compressed input and
+ * returns a stream of its text, or NULL. On POSIX a forked feeder pipes in
+ * the input already held and then whatever rest still has, so pipes and
+ * stdin work as well as files. Windows hands the tool the file itself.
+ * Either way rest is closed here, and nothing is written to disk.
+ */
+static FILE *start_decompressor(const char *filename, const char *tool, struct input_buffer *input) {
+  #ifdef _WIN32
+    wchar_t wide[MAX_PATH_LENGTH * 4];
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE reader, writer;
+    FILE *output = NULL;
+    
+    if (input->rest) {
+      fclose(input->rest);
+      input->rest = NULL;
+    }
+    if (wide_path(filename, wide, MAX_PATH_LENGTH * 4) == 0) {
+      file = CreateFileW(wide, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+          FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    }
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+    if (!CreatePipe(&reader, &writer, NULL, 0)) {
+      CloseHandle(file);
+      return NULL;
+    }
+    input->process = spawn_tool(tool, "-q -d -c", file, writer);
+    CloseHandle(file);
+    CloseHandle(writer);
+    int fd = input->process ? _open_osfhandle((intptr_t)reader, _O_RDONLY | _O_BINARY) : -1;
+    if (fd >= 0) output = _fdopen(fd, "rb");
+    if (!output) {
+      if (fd >= 0) {
+        _close(fd);
+      } else {
+        CloseHandle(reader);
+      }
+      if (input->process) wait_tool(input->process);
+      input->process = NULL;
+      return NULL;
+    }
+    input->tool = tool;
+    return output;
+  #else
+    int in[2];
+    int out[2];
+    (void)filename;
+    if (open_pipe(in) != 0) {
+      close_rest(input);
+      return NULL;
+    }
+    if (open_pipe(out) != 0) {
+      close(in[0]);
+      close(in[1]);
+      close_rest(input);
+      return NULL;
+    }
+    
+    pid_t child = fork();
+    if (child == 0) {
+      dup2(in[0], STDIN_FILENO);
+      dup2(out[1], STDOUT_FILENO);
+      close(in[0]);
+      close(in[1]);
+      close(out[0]);
+      close(out[1]);
+      execlp(tool, tool, "-q", "-d", "-c", (char *)NULL);
+      _exit(127);
+    }
+    pid_t feeder = child > 0 ? fork() : -1;
+    if (feeder == 0) {
+      char chunk[COMPARE_CHUNK_SIZE];
+      const char *p = input->data;
+      size_t left = input->size;
+      close(in[0]);
+      close(out[0]);
+      close(out[1]);
+      for (;;) {
+        while (left > 0) {
+          ssize_t n = write(in[1], p, left);
+          if (n < 0 && errno == EINTR) continue;
+          if (n <= 0) _exit(1);
+          p += n;
+          left -= (size_t)n;
+        }
+        if (!input->rest || (left = fread(chunk, 1, sizeof(chunk), input->rest)) == 0) break;
+        p = chunk;
+      }
+      _exit(input->rest && ferror(input->rest));
+    }
+    close(in[0]);
+    close(in[1]);
+    close(out[1]);
+    close_rest(input);
+    
+    FILE *output = child > 0 && feeder > 0 ? fdopen(out[0], "r") : NULL;
+    if (!output) {
+      close(out[0]);
+      wait_decompressor(child, feeder);
+      return NULL;
+    }
+    input->child = child;
+    input->feeder = feeder;
+    input->tool = tool;
+    return output;
+  #endif
+}
+
+/*
+ * Replaces a compressed input with its text. With input->stream the text
+ * is left in rest for process_rest(), which takes it a buffer at a time,
+ * so a compressed transcript never has to fit in memory. Otherwise (an
+ * archive, --incremental and --dry-run need whole files) it is unpacked
+ * into the heap buffer, and text beyond the buffer's limit is left in rest.
+ */
+int decompress_input(const char *filename, const char *tool, struct input_buffer *input) {
+  int failed = 0;
+  
+  FILE *output = start_decompressor(filename, tool, input);
+  #ifndef _WIN32
+    if (input->mapped) {
+      munmap(input->data, input->size);
+      input->mapped = 0;
+    }
+  #endif
+  input->data = input->buffer;
+  input->size = 0;
+  if (!output) {
+    fprintf(stderr, "%s: %s could not decompress %s: %s\n", PROGRAM_NAME, tool, filename,
+        strerror(errno));
+    errno = EIO;
+    return -1;
+  }
+  
+  for (;;) {
+    if (input_reserve(input) != 0) {
+      if (errno == EFBIG) {
+        input->rest = output;
+        return 0;
+      }
+      failed = 1;
+      break;
+    }
+    if (input->stream) {
+      input->rest = output;
+      return 0;
+    }
+    size_t n = fread(input->buffer + input->size, 1, input->capacity - input->size, output);
+    input->size += n;
+    if (n == 0) break;
+  }
+  if (ferror(output)) failed = 1;
+  fclose(output);
+  if (end_decompressor(input) != 0) failed = 1;
+  
+  if (failed) {
+    fprintf(stderr, "%s: %s could not decompress %s\n", PROGRAM_NAME, tool, filename);
+    input->size = 0;
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+
+int load_input(const char *filename, int use_mmap, struct input_buffer *input) {
+  if (!filename || !input) return -1;
+  
+  // Drop the previous input's mapping; a heap buffer is reused below
+  #ifndef _WIN32
+    if (input->mapped) {
+      munmap(input->data, input->size);
+      input->mapped = 0;
+    }
+  #endif
+  close_rest(input);
+  input->data = input->buffer;
+  input->size = 0;
+  
+  #ifndef _WIN32
+    // Map regular files directly; pipes and empty files fall through to read()
+    if (use_mmap) {
+      int fd = open(filename, O_RDONLY);
+      if (fd < 0) return -1;
+      
+      struct stat st;
+      if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+          madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+          close(fd);
+          input->data = map;
+          input->size = (size_t)st.st_size;
+          input->mapped = 1;
+          stat_add(STATS.bytes_read, input->size);
+          const char *tool = input_decompressor(input->data, input->size);
+          return tool ? decompress_input(filename, tool, input) : 0;
+        }
+      }
+      close(fd);
+    }
+  #else
+    (void)use_mmap;
+  #endif
+  
+  FILE *file = fopen(filename, "r");
+  if (!file) return -1;
+  
+  int full = 0;
+  for (;;) {
+    if (input_reserve(input) != 0) {
+      if (errno == EFBIG) {
+        full = 1;
+        break;
+      }
+      fclose(file);
+      return -1;
+    }
+    
+    size_t n = fread(input->buffer + input->size, 1, input->capacity - input->size, file);
+    input->size += n;
+    if (n == 0) break;
+    // A compressed input that is streamed only needs its magic number read here
+    if (input->stream && input->size >= 4 && input_decompressor(input->data, input->size)) {
+      full = 1;
+      break;
+    }
+  }
+  
+  if (ferror(file)) {
+    fclose(file);
+    input->size = 0;
+    errno = EIO;
+    return -1;
+  }
+  if (full) {
+    input->rest = file;
+  } else {
+    fclose(file);
+  }
+  stat_add(STATS.bytes_read, input->size);
+  const char *tool = input_decompressor(input->data, input->size);
+  return tool ? decompress_input(filename, tool, input) : 0;
+}
+
+/*
+ * Parses an input that outgrew --max-mem as a stream, as if it came from
+ * "-": the text read so far goes to the push parser, then the rest a
+ * buffer at a time, and files are written as their content arrives.
+ * Neither an archive nor --incremental can take a file before its end, so
+ * with either the input fails instead.
+ */
+int process_rest(const char *filename, struct input_buffer *input, const struct output *out) {
+  static const struct ai2fs_callbacks callbacks = { stream_begin, stream_data, stream_end };
+  struct dir_cache seen = {0};
+  struct stream_file file = { out, out->first_wins ? &seen : NULL, {0}, {0}, {0}, {0}, -1, 0, 0, 0, 0 };
+  ai2fs_parser *parser = NULL;
+  int status = 0;
+  
+  if (out->tar || out->incremental) {
+    fprintf(stderr, "%s: %s is larger than --max-mem, which %s cannot stream\n", PROGRAM_NAME,
+        filename, out->tar ? "--output=tar" : "--incremental");
+    close_rest(input);
+    return 1;
+  }
+  parser = ai2fs_parser_new(MARKERS, &callbacks, &file);
+  if (!parser) {
+    perror("Memory allocation failed");
+    close_rest(input);
+    return 1;
+  }
+  
+  size_t n = input->size;
+  for (;;) {
+    if (ai2fs_parser_feed(parser, input->data, n) != 0) {
+      perror("Memory allocation failed");
+      status = 1;
+      break;
+    }
+    log_flush(out->log);
+    n = fread(input->buffer, 1, input->capacity, input->rest);
+    if (n == 0) break;
+    stat_add(STATS.bytes_read, n);
+  }
+  
+  ai2fs_parser_finish(parser);
+  if (file.fd >= 0) stream_end(&file);
+  count_parse(ai2fs_parser_counts(parser));
+  stat_max(STATS.peak_buffer, input->capacity + ai2fs_parser_counts(parser)->held_capacity);
+  
+  const char *tool = input->tool;
+  if (close_rest(input) != 0 && status == 0) {
+    if (tool) {
+      fprintf(stderr, "%s: %s could not decompress %s\n", PROGRAM_NAME, tool, filename);
+    } else {
+      fprintf(stderr, "Error reading input file %s\n", filename);
+    }
+    status = 1;
+  }
+  input->size = 0;
+  ai2fs_parser_free(parser);
+  free_dir_cache(&seen);
+  return status;
+}
+
+void release_input(struct input_buffer *input) {
+  if (!input) return;
+  
+  #ifndef _WIN32
+    if (input->mapped) {
+      munmap(input->data, input->size);
+      input->mapped = 0;
+    }
+  #endif
+  close_rest(input);
+  free(input->buffer);
+  input->buffer = NULL;
+  input->data = NULL;
+  input->size = 0;
+  input->capacity = 0;
+}
+
+static void glob_add(struct glob *glob, enum glob_op op, const char *text, size_t len) {
+  glob->steps[glob->count].op = op;
+  glob->steps[glob->count].text = text;
+  glob->steps[glob->count].len = len;
+  glob->count++;
+}
+
+/* Compiles pattern into steps once; the steps point into pattern */
+static int glob_compile(struct glob *glob, const char *pattern) {
+  size_t len = strlen(pattern);
+  const char *p = pattern;
+  
+  glob->steps = malloc((len + 1) * sizeof(*glob->steps));
+  if (!glob->steps) return -1;
+  glob->count = 0;
+  glob->name_only = strchr(pattern, '/') == NULL;
+  
+  while (*p) {
+    // "**/" may match no directory only where a directory name starts
+    if (p[0] == '*' && p[1] == '*' && p[2] == '/' && (p == pattern || p[-1] == '/')) {
+      glob_add(glob, GLOB_DIRS, NULL, 0);
+      p += 3;
+    } else if (p[0] == '*' && p[1] == '*') {
+      glob_add(glob, GLOB_DEEP, NULL, 0);
+      while (*p == '*') {
+        p++;
+      }
+    } else if (*p == '*' || *p == '?') {
+      glob_add(glob, *p == '*' ? GLOB_STAR : GLOB_ONE, NULL, 0);
+      p++;
+    } else {
+      const char *start = p;
+      while (*p && *p != '*' && *p != '?') {
+        p++;
+      }
+      glob_add(glob, GLOB_LITERAL, start, (size_t)(p - start));
+    }
+  }
+  if (len > 0 && pattern[len - 1] == '/') glob_add(glob, GLOB_DEEP, NULL, 0);
+  return 0;
+}
+
+/*
+ * Matches s against the steps without recursion. On a mismatch only the
+ * latest "*" takes one more character, or, once it would cross '/', the
+ * latest "**" does (one followed by '/' skips to the next directory).
+ * Neither is ever retried for an earlier one: '/' is not matched by "*",
+ * so it pins the "*" runs, and a later "**" takes whatever an earlier one
+ * could have. The work is polynomial in the path and pattern, not
+ * exponential in the number of stars.
+ */
+static int glob_steps_match(const struct glob_step *step, const struct glob_step *last,
+    const char *s, const char *end) {
+  const struct glob_step *star = NULL;
+  const struct glob_step *deep = NULL;
+  const char *star_at = NULL;
+  const char *deep_at = NULL;
+  int deep_dirs = 0;
+  
+  for (;;) {
+    if (step < last) {
+      switch (step->op) {
+        case GLOB_LITERAL:
+          if ((size_t)(end - s) >= step->len && memcmp(s, step->text, step->len) == 0) {
+            s += step->len;
+            step++;
+            continue;
+          }
+          break;
+        case GLOB_ONE:
+          if (s < end && *s != '/') {
+            s++;
+            step++;
+            continue;
+          }
+          break;
+        case GLOB_STAR:
+          star = ++step;
+          star_at = s;
+          continue;
+        default:
+          deep_dirs = step->op == GLOB_DIRS;
+          deep = ++step;
+          deep_at = s;
+          star = NULL;
+          continue;
+      }
+    } else if (s == end) {
+      return 1;
+    }
+    
+    if (star && star_at < end && *star_at != '/') {
+      s = ++star_at;
+      step = star;
+    } else if (deep && deep_at < end) {
+      if (deep_dirs) {
+        const char *slash = memchr(deep_at, '/', end - deep_at);
+        if (!slash) return 0;
+        deep_at = slash;
+      }
+      s = ++deep_at;
+      step = deep;
+      star = NULL;
+    } else {
+      return 0;
+    }
+  }
+}
+
+static int glob_match(const struct glob *glob, const char *path) {
+  const char *subject = path;
+  
+  if (glob->name_only) {
+    const char *slash = strrchr(path, '/');
+    if (slash) subject = slash + 1;
+  }
+  return glob_steps_match(glob->steps, glob->steps + glob->count, subject,
+      subject + strlen(subject));
+}
+
+static int glob_list_compile(struct glob **globs, const char **patterns, size_t count) {
+  size_t i;
+  
+  if (count == 0) return 0;
+  *globs = calloc(count, sizeof(**globs));
+  if (!*globs) return -1;
+  for (i = 0; i < count; i++) {
+    if (glob_compile(&(*globs)[i], patterns[i]) != 0) return -1;
+  }
+  return 0;
+}
+
+int path_filter_init(struct path_filter *filter, const struct options *opts) {
+  memset(filter, 0, sizeof(*filter));
+  filter->include_count = opts->include_count;
+  filter->exclude_count = opts->exclude_count;
+  if (glob_list_compile(&filter->includes, opts->includes, opts->include_count) != 0 ||
+      glob_list_compile(&filter->excludes, opts->excludes, opts->exclude_count) != 0) {
+    path_filter_free(filter);
+    return -1;
+  }
+  return 0;
+}
+
+/* Decides once per extracted file whether it is written */
+int path_selected(const struct path_filter *filter, const char *path) {
+  size_t i;
+  
+  if (!filter) return 1;
+  for (i = 0; i < filter->include_count; i++) {
+    if (glob_match(&filter->includes[i], path)) break;
+  }
+  if (filter->include_count > 0 && i == filter->include_count) return 0;
+  for (i = 0; i < filter->exclude_count; i++) {
+    if (glob_match(&filter->excludes[i], path)) return 0;
+  }
+  return 1;
+}
+
+void path_filter_free(struct path_filter *filter) {
+  size_t i;
+  
+  if (filter->includes) {
+    for (i = 0; i < filter->include_count; i++) {
+      free(filter->includes[i].steps);
+    }
+  }
+  if (filter->excludes) {
+    for (i = 0; i < filter->exclude_count; i++) {
+      free(filter->excludes[i].steps);
+    }
+  }
+  free(filter->includes);
+  free(filter->excludes);
+  memset(filter, 0, sizeof(*filter));
+}
+
+/*
+ * Hands a finished file to the archive, the writer pool, the ring or the
+ * batch, or writes it inline. An ordered file must be written after every
+ * ordered file emitted before it: it goes to the pool's first writer, or
+ * is written inline instead of joining the ring or the batch.
+ */
+static void emit_file(struct writer_pool *pool, const struct output *out,
+    const char *path, const char *data, size_t size, int ordered) {
+  if (!path_selected(out->filter, path)) {
+    stat_add(STATS.filtered, 1);
+    return;
+  }
+  if (out->max_file_size && size > out->max_file_size) {
+    fprintf(stderr, "Error writing file %s/%s: larger than --max-file-size\n", out->root, path);
+    count_write(out->totals, WRITE_FAILED);
+    return;
+  }
+  if (out->tar) {
+    tar_add(out->tar, out, path, data, size);
+    return;
+  }
+  if (pool) {
+    writer_pool_submit(pool, out, path, data, size, ordered);
+    return;
+  }
+  create_directories(out->dirs, out->root, path);
+  #ifdef AI2FS_URING
+    if (!ordered && out->ring && uring_write_file(out->ring, out, path, data, size) == 0) return;
+  #endif
+  #ifdef AI2FS_OVERLAPPED
+    if (!ordered && out->batch && overlapped_write_file(out->batch, out, path, data, size) == 0) return;
+  #endif
+  write_file_block(out, path, data, size);
+}
+
+/* A file of a loaded transcript: its path and its slice of the input */
+struct parsed_file {
+  const char *path;
+  size_t path_len;
+  const char *data;
+  size_t size;
+  int repeated;
+  int ordered;
+};
+
+/* The files of a transcript in input order, collected so repeats can be dropped */
+struct file_list {
+  struct parsed_file *files;
+  size_t count;
+  size_t capacity;
+  struct arena paths;
+  int failed;
+};
+
+static void file_list_add(struct file_list *list, const char *path, size_t path_len,
+    const char *data, size_t size) {
+  if (list->failed) return;
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity ? list->capacity * 2 : 256;
+    struct parsed_file *grown = realloc(list->files, capacity * sizeof(*grown));
+    if (!grown) {
+      list->failed = 1;
+      return;
+    }
+    list->files = grown;
+    list->capacity = capacity;
+  }
+  
+  char *copy = arena_alloc(&list->paths, path_len + 1);
+  if (!copy) {
+    list->failed = 1;
+    return;
+  }
+  memcpy(copy, path, path_len);
+  copy[path_len] = '\0';
+  
+  struct parsed_file *file = &list->files[list->count++];
+  file->path = copy;
+  file->path_len = path_len;
+  file->data = data;
+  file->size = size;
+  file->repeated = 0;
+  file->ordered = 0;
+}
+
+static void file_list_free(struct file_list *list) {
+  free(list->files);
+  arena_free(&list->paths);
+  memset(list, 0, sizeof(*list));
+}
+
+/*
+ * Marks the files whose path is also a directory of another file in the
+ * list, or has such a path as a directory. Which of them wins on disk
+ * depends on the order of their writes (a file named like a directory
+ * fails, and so does a file under a directory taken by a file), so these
+ * keep every block and their order. Returns -1 if out of memory.
+ */
+static int mark_ordered_files(struct file_list *list) {
+  struct dir_cache paths = {0};
+  struct dir_cache colliding = {0};
+  int failed = 0;
+  size_t i, k;
+  
+  for (i = 0; i < list->count && !failed; i++) {
+    const struct parsed_file *file = &list->files[i];
+    if (!dir_cache_contains(&paths, file->path, file->path_len) &&
+        dir_cache_insert(&paths, file->path, file->path_len) != 0) {
+      failed = 1;
+    }
+  }
+  for (i = 0; i < list->count && !failed; i++) {
+    const struct parsed_file *file = &list->files[i];
+    for (k = 1; k < file->path_len && !failed; k++) {
+      if (file->path[k] == '/' && dir_cache_contains(&paths, file->path, k)) {
+        if ((!dir_cache_contains(&colliding, file->path, k) &&
+            dir_cache_insert(&colliding, file->path, k) != 0) ||
+            (!dir_cache_contains(&colliding, file->path, file->path_len) &&
+            dir_cache_insert(&colliding, file->path, file->path_len) != 0)) {
+          failed = 1;
+        }
+      }
+    }
+  }
+  for (i = 0; i < list->count && !failed && colliding.count > 0; i++) {
+    struct parsed_file *file = &list->files[i];
+    file->ordered = dir_cache_contains(&colliding, file->path, file->path_len);
+  }
+  free_dir_cache(&paths);
+  free_dir_cache(&colliding);
+  return failed ? -1 : 0;
+}
+
+/*
+ * Emits the files of a transcript in input order, each path once: its last
+ * block, or its first with out->first_wins. One pass over the list, from
+ * the end unless the first block wins, marks the blocks that are
+ * overwritten anyway, so they cost no open or write. A path that meets a
+ * directory of another file (see mark_ordered_files()) keeps every block
+ * when the last one wins, and is written in input order even with -j or
+ * io_uring, so the tree comes out as in a sequential run.
+ */
+static void emit_files(struct file_list *list, const struct output *out,
+    struct writer_pool *pool) {
+  struct dir_cache seen = {0};
+  size_t i;
+  
+  if (mark_ordered_files(list) != 0) {
+    fprintf(stderr, "%s: out of memory finding repeated paths, writing every block\n",
+        PROGRAM_NAME);
+    for (i = 0; i < list->count; i++) {
+      emit_file(pool, out, list->files[i].path, list->files[i].data, list->files[i].size, 1);
+    }
+    return;
+  }
+  for (i = 0; i < list->count; i++) {
+    struct parsed_file *file = &list->files[out->first_wins ? i : list->count - 1 - i];
+    if (file->ordered && !out->first_wins) continue;
+    if (dir_cache_contains(&seen, file->path, file->path_len)) {
+      file->repeated = 1;
+      stat_add(STATS.repeated, 1);
+    } else if (dir_cache_insert(&seen, file->path, file->path_len) != 0) {
+      fprintf(stderr, "%s: out of memory finding repeated paths, writing every block\n",
+          PROGRAM_NAME);
+      break;
+    }
+  }
+  free_dir_cache(&seen);
+  
+  for (i = 0; i < list->count; i++) {
+    const struct parsed_file *file = &list->files[i];
+    if (!file->repeated) emit_file(pool, out, file->path, file->data, file->size, file->ordered);
+  }
+}
+
+/*
+ * The file being collected by process_input(); pieces of it are contiguous
+ * in the input. It is added to list, or emitted at once if list is NULL.
+ */
+struct input_file {
+  struct writer_pool *pool;
+  const struct output *out;
+  struct file_list *list;
+  char path[MAX_PATH_LENGTH];
+  const char *data;
+  size_t size;
+};
+
+static int input_begin(void *context, const char *path, int marker) {
+  struct input_file *file = context;
+  
+  (void)marker;
+  memcpy(file->path, path, strlen(path) + 1);
+  file->data = "";
+  file->size = 0;
+  return 0;
+}
+
+static int input_data(void *context, const char *data, size_t len) {
+  struct input_file *file = context;
+  
+  if (file->size == 0) file->data = data;
+  file->size += len;
+  return 0;
+}
+
+static int input_end(void *context) {
+  struct input_file *file = context;
+  
+  if (file->list) {
+    file_list_add(file->list, file->path, strlen(file->path), file->data, file->size);
+  } else {
+    emit_file(file->pool, file->out, file->path, file->data, file->size, 0);
+  }
+  return 0;
+}
+
+/*
+ * Splits a loaded transcript into files under out->root. The files are
+ * listed first, so a repeated path is written only once; without memory
+ * for the list they are written as they are found.
+ */
+void process_input(const struct input_buffer *input, const struct output *out,
+    struct writer_pool *pool) {
+  static const struct ai2fs_callbacks callbacks = { input_begin, input_data, input_end };
+  struct file_list list = {0};
+  struct input_file file = { pool, out, &list, {0}, NULL, 0 };
+  struct ai2fs_counts counts;
+  
+  if (!out->quiet && !out->tar) log_message(out->log, "Root folder '", out->root, "' created.");
+  
+  ai2fs_parse(MARKERS, input->data, input->size, &callbacks, &file, &counts);
+  if (list.failed) {
+    fprintf(stderr, "%s: out of memory listing files, writing repeated paths every time\n",
+        PROGRAM_NAME);
+    file.list = NULL;
+    ai2fs_parse(MARKERS, input->data, input->size, &callbacks, &file, &counts);
+  } else {
+    emit_files(&list, out, pool);
+  }
+  count_parse(&counts);
+  file_list_free(&list);
+}
+
+/* A path line found by a parse thread; line and path point into the input */
+struct path_line {
+  const char *line;
+  const char *path;
+  size_t path_len;
+  const char *content;
+};
+
+/* One slice of the input for process_input_parallel(): lines in, path lines out */
+struct parse_chunk {
+  const char *start;
+  const char *end;
+  struct path_line *lines;
+  size_t count;
+  size_t capacity;
+  struct ai2fs_counts counts;
+  int failed;
+};
+
+/* Classifies every line of a chunk; a chunk always starts at a line start */
+static THREAD_RETURN parse_thread(void *arg) {
+  struct parse_chunk *chunk = arg;
+  const char *p = chunk->start;
+  
+  while (p < chunk->end) {
+    const char *newline = memchr(p, '\n', chunk->end - p);
+    const char *next = newline ? newline + 1 : chunk->end;
+    struct ai2fs_span span;
+    int marker = ai2fs_classify_line(MARKERS, p, next - p, &span);
+    
+    chunk->counts.lines++;
+    if (marker != AI2FS_NO_MARKER) {
+      chunk->counts.markers[marker]++;
+      if (chunk->count == chunk->capacity) {
+        size_t capacity = chunk->capacity ? chunk->capacity * 2 : 1024;
+        struct path_line *grown = realloc(chunk->lines, capacity * sizeof(*grown));
+        if (!grown) {
+          chunk->failed = 1;
+          break;
+        }
+        chunk->lines = grown;
+        chunk->capacity = capacity;
+      }
+      struct path_line *found = &chunk->lines[chunk->count++];
+      found->line = p;
+      found->path = p + span.start;
+      found->path_len = span.len;
+      found->content = next;
+    }
+    p = next;
+  }
+  return 0;
+}
+
+/*
+ * Like process_input(), with the line scan spread over up to threads
+ * threads. The input is cut into chunks at newlines, so every line is
+ * classified whole by exactly one thread; a file's content then runs from
+ * its path line to the next one in input order, whichever chunk that is
+ * in. Files are listed in order from this thread and emitted as by
+ * process_input(), so the result is the same as a sequential parse.
+ */
+void process_input_parallel(const struct input_buffer *input, const struct output *out,
+    struct writer_pool *pool, int threads) {
+  size_t chunk_count = input->size / PARSE_CHUNK_MIN;
+  if (chunk_count > (size_t)threads) chunk_count = (size_t)threads;
+  if (chunk_count < 2) {
+    process_input(input, out, pool);
+    return;
+  }
+  
+  struct parse_chunk *chunks = calloc(chunk_count, sizeof(*chunks));
+  if (!chunks) {
+    process_input(input, out, pool);
+    return;
+  }
+  
+  const char *end = input->data + input->size;
+  const char *start = input->data;
+  size_t i, j;
+  for (i = 0; i < chunk_count; i++) {
+    const char *cut = i + 1 == chunk_count ? end : input->data + input->size / chunk_count * (i + 1);
+    if (cut < start) cut = start;
+    if (cut < end && cut > input->data && cut[-1] != '\n') {
+      const char *newline = memchr(cut, '\n', end - cut);
+      cut = newline ? newline + 1 : end;
+    }
+    chunks[i].start = start;
+    chunks[i].end = cut;
+    start = cut;
+  }
+  
+  // The first chunk is scanned here while the others run
+  thread_handle handles[MAX_WRITERS];
+  int started[MAX_WRITERS] = {0};
+  for (i = 1; i < chunk_count; i++) {
+    started[i] = thread_start(&handles[i], parse_thread, &chunks[i]) == 0;
+  }
+  parse_thread(&chunks[0]);
+  int failed = chunks[0].failed;
+  for (i = 1; i < chunk_count; i++) {
+    if (started[i]) {
+      thread_join(handles[i]);
+    } else {
+      parse_thread(&chunks[i]);
+    }
+    failed |= chunks[i].failed;
+  }
+  
+  // Stitch: each file ends where the next path line starts
+  struct file_list list = {0};
+  if (!failed) {
+    const struct path_line *current = NULL;
+    for (i = 0; i < chunk_count; i++) {
+      for (j = 0; j < chunks[i].count; j++) {
+        if (current) {
+          file_list_add(&list, current->path, current->path_len, current->content,
+              chunks[i].lines[j].line - current->content);
+        }
+        current = &chunks[i].lines[j];
+      }
+    }
+    if (current) {
+      file_list_add(&list, current->path, current->path_len, current->content,
+          end - current->content);
+    }
+    failed = list.failed;
+  }
+  
+  if (failed) {
+    fprintf(stderr, "%s: out of memory in the parallel parse, parsing sequentially\n", PROGRAM_NAME);
+  } else {
+    if (!out->quiet && !out->tar) log_message(out->log, "Root folder '", out->root, "' created.");
+    for (i = 0; i < chunk_count; i++) {
+      count_parse(&chunks[i].counts);
+    }
+    emit_files(&list, out, pool);
+  }
+  
+  for (i = 0; i < chunk_count; i++) {
+    free(chunks[i].lines);
+  }
+  free(chunks);
+  file_list_free(&list);
+  if (failed) process_input(input, out, pool);
+}
+
+static int cpu_count(void) {
+  #ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    long n = (long)info.dwNumberOfProcessors;
+  #else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+  #endif
+  if (n < 1) return 1;
+  return n > MAX_WRITERS ? MAX_WRITERS : (int)n;
+}
+
+/* One transcript of a batch and the root folder it is written to */
+struct batch_entry {
+  const char *filename;
+  char root[MAX_PATH_LENGTH];
+  struct output out;
+};
+
+/* Work shared by the batch threads: the next entry to take and the failure count */
+struct batch_state {
+  struct batch_entry *entries;
+  size_t count;
+  size_t next;
+  int failures;
+  int use_mmap;
+  size_t max_mem;
+  mutex_handle lock;
+};
+
+/* Takes entries until none are left, reusing one input buffer for all of them */
+static THREAD_RETURN batch_thread(void *arg) {
+  struct batch_state *state = arg;
+  struct input_buffer input = {0};
+  
+  input.limit = state->max_mem;
+  for (;;) {
+    mutex_lock(&state->lock);
+    size_t index = state->next++;
+    mutex_unlock(&state->lock);
+    if (index >= state->count) break;
+    
+    struct batch_entry *entry = &state->entries[index];
+    input.stream = !entry->out.tar && !entry->out.incremental;
+    if (load_input(entry->filename, state->use_mmap, &input) != 0) {
+      fprintf(stderr, "Error opening input file %s: %s\n", entry->filename, strerror(errno));
+      mutex_lock(&state->lock);
+      state->failures++;
+      mutex_unlock(&state->lock);
+      continue;
+    }
+    if (input.rest) {
+      if (process_rest(entry->filename, &input, &entry->out) != 0) {
+        mutex_lock(&state->lock);
+        state->failures++;
+        mutex_unlock(&state->lock);
+      }
+      continue;
+    }
+    process_input(&input, &entry->out, NULL);
+  }
+  
+  release_input(&input);
+  return 0;
+}
+
+/*
+ * Names the root folder of each batch input after its file name without
+ * the extension, under ROOT_FOLDER; repeated names get a -2, -3... suffix.
+ */
+static void name_batch_root(struct batch_entry *entry, struct dir_cache *names) {
+  const char *base = entry->filename;
+  const char *p;
+  
+  for (p = entry->filename; *p; p++) {
+    if (*p == '/' || *p == '\\') base = p + 1;
+  }
+  const char *dot = strrchr(base, '.');
+  int base_len = (int)(dot && dot != base ? (size_t)(dot - base) : strlen(base));
+  if (base_len == 0) {
+    base = "input";
+    base_len = 5;
+  }
+  
+  int copy;
+  for (copy = 1;; copy++) {
+    if (copy == 1) {
+      snprintf(entry->root, sizeof(entry->root), "%s/%.*s", ROOT_FOLDER, base_len, base);
+    } else {
+      snprintf(entry->root, sizeof(entry->root), "%s/%.*s-%d", ROOT_FOLDER, base_len, base, copy);
+    }
+    if (!dir_cache_contains(names, entry->root, strlen(entry->root))) break;
+  }
+  dir_cache_insert(names, entry->root, strlen(entry->root));
+}
+
+int run_batch(const struct options *opts, const struct output *base) {
+  struct batch_state state;
+  struct dir_cache names = {0};
+  size_t i;
+  
+  state.entries = calloc(opts->input_count, sizeof(*state.entries));
+  if (!state.entries) {
+    perror("Memory allocation failed");
+    return 1;
+  }
+  for (i = 0; i < opts->input_count; i++) {
+    state.entries[i].filename = opts->inputs[i];
+    name_batch_root(&state.entries[i], &names);
+    state.entries[i].out = *base;
+    state.entries[i].out.root = state.entries[i].root;
+  }
+  free_dir_cache(&names);
+  
+  state.count = opts->input_count;
+  state.next = 0;
+  state.failures = 0;
+  state.use_mmap = opts->use_mmap;
+  state.max_mem = opts->max_mem;
+  mutex_init(&state.lock);
+  
+  // Spread inputs over the cores; each thread writes its inputs itself
+  int threads = opts->jobs ? opts->jobs : cpu_count();
+  if ((size_t)threads > state.count) threads = (int)state.count;
+  
+  thread_handle handles[MAX_WRITERS];
+  int started = 0;
+  if (threads > 1) {
+    dir_cache_share(base->dirs);
+    for (started = 0; started < threads; started++) {
+      if (thread_start(&handles[started], batch_thread, &state) != 0) break;
+    }
+  }
+  if (started == 0) {
+    batch_thread(&state);
+  }
+  for (i = 0; i < (size_t)started; i++) {
+    thread_join(handles[i]);
+  }
+  
+  mutex_destroy(&state.lock);
+  free(state.entries);
+  return state.failures ? 1 : 0;
+}
+
+#ifndef _WIN32
+/* A --serve workspace: its output root and the caches kept warm across requests */
+struct serve_root {
+  char root[MAX_PATH_LENGTH];
+  struct dir_cache dirs;
+  struct content_index index;
+  mutex_handle lock;
+  struct serve_root *next;
+};
+
+/* Connections accepted but not yet taken by a worker, and every root seen */
+struct serve_state {
+  const struct output *base;
+  const char *workspaces;
+  int clients[SERVE_QUEUE_DEPTH];
+  size_t head;
+  size_t count;
+  int closed;
+  size_t max_mem;
+  mutex_handle lock;
+  cond_handle not_empty;
+  cond_handle not_full;
+  struct serve_root *roots;
+};
+
+/* The entry for root, created on first use; NULL if out of memory */
+static struct serve_root *serve_root_for(struct serve_state *state, const char *root) {
+  struct serve_root *entry;
+  
+  mutex_lock(&state->lock);
+  for (entry = state->roots; entry; entry = entry->next) {
+    if (strcmp(entry->root, root) == 0) break;
+  }
+  if (!entry && (entry = calloc(1, sizeof(*entry))) != NULL) {
+    memcpy(entry->root, root, strlen(root) + 1);
+    mutex_init(&entry->lock);
+    entry->next = state->roots;
+    state->roots = entry;
+  }
+  mutex_unlock(&state->lock);
+  return entry;
+}
+
+/*
+ * Reads a request until the client shuts down its end. One that outgrows
+ * --max-mem is read to its end and dropped, so the client still gets the
+ * reply, and fails with EFBIG. One that sends nothing for
+ * SERVE_IDLE_TIMEOUT seconds fails with EAGAIN.
+ */
+static int read_request(int fd, struct input_buffer *input) {
+  int too_large = 0;
+  
+  input->data = input->buffer;
+  input->size = 0;
+  for (;;) {
+    if (input_reserve(input) != 0) {
+      if (errno != EFBIG) return -1;
+      too_large = 1;
+      input->size = 0;
+    }
+    
+    ssize_t n = read(fd, input->buffer + input->size, input->capacity - input->size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return -1;
+    if (n == 0) break;
+    input->size += (size_t)n;
+  }
+  if (too_large) {
+    errno = EFBIG;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Replaces workspace (size bytes long) by its path with symlinks resolved,
+ * which is then written to, so swapping a link afterwards cannot move the
+ * output. Non-zero if the result lies inside --workspaces.
+ */
+static int serve_allows(const struct serve_state *state, char *workspace, size_t size) {
+  char resolved[PATH_MAX];
+  size_t len = strlen(state->workspaces);
+  
+  if (!realpath(workspace, resolved) || strlen(resolved) >= size) return 0;
+  memcpy(workspace, resolved, strlen(resolved) + 1);
+  // The root directory holds everything; any other base must end at a '/'
+  if (len == 1) return 1;
+  return strncmp(resolved, state->workspaces, len) == 0 &&
+      (resolved[len] == '\0' || resolved[len] == '/');
+}
+
+/*
+ * Handles one connection. The request is the workspace directory on the
+ * first line, then the transcript; the reply is the progress messages and
+ * a "Files:" summary, or one "Error:" line. Requests for the same
+ * workspace take turns on its root's lock.
+ */
+static void serve_client(struct serve_state *state, int fd, struct input_buffer *input,
+    struct progress_log *log) {
+  char root[MAX_PATH_LENGTH];
+  const char *error = NULL;
+  
+  log->fd = fd;
+  const char *newline = NULL;
+  if (read_request(fd, input) != 0) {
+    if (errno == EFBIG) {
+      error = "request is larger than --max-mem";
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      error = "timed out waiting for the request";
+    } else {
+      error = strerror(errno);
+    }
+  } else if (!(newline = memchr(input->data, '\n', input->size))) {
+    error = "expected the workspace directory on the first line";
+  } else {
+    size_t len = (size_t)(newline - input->data);
+    if (len > 0 && input->data[len - 1] == '\r') len--;
+    
+    // Files go to <workspace>/generated-code, as when ai2fs runs there
+    struct stat st;
+    if (len == 0 || len + sizeof(ROOT_FOLDER) + 1 > sizeof(root)) {
+      error = "workspace directory missing or too long";
+    } else {
+      memcpy(root, input->data, len);
+      root[len] = '\0';
+      if (stat(root, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        error = "workspace is not a directory";
+      } else if (state->workspaces && !serve_allows(state, root, sizeof(root) - sizeof(ROOT_FOLDER) - 1)) {
+        error = "workspace is outside --workspaces";
+      }
+      len = strlen(root);
+      root[len] = '/';
+      memcpy(root + len + 1, ROOT_FOLDER, sizeof(ROOT_FOLDER));
+    }
+  }
+  
+  struct serve_root *entry = error ? NULL : serve_root_for(state, root);
+  if (!error && !entry) error = strerror(ENOMEM);
+  if (error) {
+    log_message(log, "Error: ", error, "");
+    log_flush(log);
+    log->fd = -1;
+    return;
+  }
+  
+  struct input_buffer transcript = {0};
+  transcript.data = (char *)newline + 1;
+  transcript.size = input->size - (size_t)(transcript.data - input->data);
+  
+  struct write_totals totals = {0};
+  mutex_init(&totals.lock);
+  struct output out = *state->base;
+  out.root = entry->root;
+  out.dirs = &entry->dirs;
+  out.totals = &totals;
+  out.log = log;
+  out.index = out.incremental ? &entry->index : NULL;
+  
+  mutex_lock(&entry->lock);
+  process_input(&transcript, &out, NULL);
+  mutex_unlock(&entry->lock);
+  
+  char summary[128];
+  snprintf(summary, sizeof(summary), "%lu created, %lu updated, %lu unchanged, %lu failed",
+      (unsigned long)totals.created, (unsigned long)totals.updated,
+      (unsigned long)totals.unchanged, (unsigned long)totals.failed);
+  log_message(log, "Files: ", summary, "");
+  log_flush(log);
+  log->fd = -1;
+  mutex_destroy(&totals.lock);
+}
+
+/* Takes connections off the queue until it is closed and empty */
+static THREAD_RETURN serve_thread(void *arg) {
+  struct serve_state *state = arg;
+  struct input_buffer input = {0};
+  struct progress_log *log = malloc(sizeof(*log));
+  
+  input.limit = state->max_mem;
+  if (!log) {
+    perror("Memory allocation failed");
+    return 0;
+  }
+  log_init(log);
+  
+  for (;;) {
+    mutex_lock(&state->lock);
+    while (state->count == 0 && !state->closed) {
+      cond_wait(&state->not_empty, &state->lock);
+    }
+    if (state->count == 0) {
+      mutex_unlock(&state->lock);
+      break;
+    }
+    int fd = state->clients[state->head];
+    state->head = (state->head + 1) % SERVE_QUEUE_DEPTH;
+    state->count--;
+    cond_signal(&state->not_full);
+    mutex_unlock(&state->lock);
+    
+    serve_client(state, fd, &input, log);
+    close(fd);
+  }
+  
+  release_input(&input);
+  log_destroy(log);
+  free(log);
+  return 0;
+}
+
+/* The listening socket, close-on-exec like the clients it accepts */
+static int serve_socket(void) {
+  #ifdef __linux__
+    return socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  #else
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0) set_cloexec(fd);
+    return fd;
+  #endif
+}
+
+/*
+ * --serve: accepts transcripts on a Unix socket until SIGINT or SIGTERM and
+ * hands each connection to one of threads workers. Directory caches and,
+ * with --incremental, content indexes live as long as the server, one per
+ * workspace. The socket is only open to the user running the server, and
+ * with workspaces set a request may only name a directory inside it.
+ */
+int run_serve(const char *socket_path, const char *workspaces, int threads, size_t max_mem,
+    const struct output *base) {
+  struct sockaddr_un addr;
+  struct serve_state state;
+  char allowed[PATH_MAX];
+  
+  if (workspaces && !realpath(workspaces, allowed)) {
+    fprintf(stderr, "Error opening %s: %s\n", workspaces, strerror(errno));
+    return 1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: socket path too long: %s\n", PROGRAM_NAME, socket_path);
+    return 1;
+  }
+  memcpy(addr.sun_path, socket_path, strlen(socket_path) + 1);
+  
+  int listener = serve_socket();
+  if (listener < 0) {
+    perror("Error creating socket");
+    return 1;
+  }
+  // A socket nobody answers on is left over from an earlier server
+  struct stat st;
+  if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    if (connect(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+      fprintf(stderr, "%s: a server is already listening on %s\n", PROGRAM_NAME, socket_path);
+      close(listener);
+      return 1;
+    }
+    close(listener);
+    unlink(socket_path);
+    listener = serve_socket();
+  }
+  // Only the user running the server may connect, and so pick where files go
+  mode_t mask = umask(077);
+  int bound = listener >= 0 && bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  umask(mask);
+  if (!bound || listen(listener, SOMAXCONN) != 0) {
+    fprintf(stderr, "Error listening on %s: %s\n", socket_path, strerror(errno));
+    if (listener >= 0) close(listener);
+    return 1;
+  }
+  
+  // No SA_RESTART, so a signal interrupts poll(); clients that hang up are not fatal
+  open_stop_pipe();
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = request_stop;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  
+  memset(&state, 0, sizeof(state));
+  state.base = base;
+  state.workspaces = workspaces ? allowed : NULL;
+  state.max_mem = max_mem;
+  mutex_init(&state.lock);
+  cond_init(&state.not_empty);
+  cond_init(&state.not_full);
+  
+  if (threads < 1) threads = cpu_count();
+  thread_handle handles[MAX_WRITERS];
+  int started;
+  for (started = 0; started < threads; started++) {
+    if (thread_start(&handles[started], serve_thread, &state) != 0) break;
+  }
+  
+  int status = 0;
+  if (started == 0) {
+    fprintf(stderr, "%s: could not start server threads\n", PROGRAM_NAME);
+    status = 1;
+  } else if (!base->quiet) {
+    printf("Serving on %s\n", socket_path);
+    fflush(stdout);
+  }
+  
+  // accept() only runs once poll() sees a connection, so a stop is never stuck behind it
+  fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+  while (started > 0 && !STOP_REQUESTED) {
+    struct pollfd ready[2] = { { listener, POLLIN, 0 }, { STOP_PIPE[0], POLLIN, 0 } };
+    if (poll(ready, STOP_PIPE[0] >= 0 ? 2 : 1, -1) < 0) {
+      if (errno == EINTR) continue;
+      perror("Error waiting for connections");
+      status = 1;
+      break;
+    }
+    if (!(ready[0].revents & POLLIN)) continue;
+    #ifdef __linux__
+      int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    #else
+      int client = accept(listener, NULL, NULL);
+      if (client >= 0) set_cloexec(client);
+    #endif
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || errno == EWOULDBLOCK) continue;
+      perror("Error accepting connection");
+      status = 1;
+      break;
+    }
+    // An idle client gives up its thread after SERVE_IDLE_TIMEOUT seconds
+    struct timeval timeout = { SERVE_IDLE_TIMEOUT, 0 };
+    fcntl(client, F_SETFL, fcntl(client, F_GETFL) & ~O_NONBLOCK);
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    mutex_lock(&state.lock);
+    while (state.count == SERVE_QUEUE_DEPTH) {
+      cond_wait(&state.not_full, &state.lock);
+    }
+    state.clients[(state.head + state.count) % SERVE_QUEUE_DEPTH] = client;
+    state.count++;
+    cond_signal(&state.not_empty);
+    mutex_unlock(&state.lock);
+  }
+  
+  // Requests already accepted are still answered
+  mutex_lock(&state.lock);
+  state.closed = 1;
+  cond_broadcast(&state.not_empty);
+  mutex_unlock(&state.lock);
+  int i;
+  for (i = 0; i < started; i++) {
+    thread_join(handles[i]);
+  }
+  close(listener);
+  unlink(socket_path);
+  close_stop_pipe();
+  
+  while (state.roots) {
+    struct serve_root *next = state.roots->next;
+    free_dir_cache(&state.roots->dirs);
+    free_content_index(&state.roots->index);
+    mutex_destroy(&state.roots->lock);
+    free(state.roots);
+    state.roots = next;
+  }
+  cond_destroy(&state.not_empty);
+  cond_destroy(&state.not_full);
+  mutex_destroy(&state.lock);
+  return status;
+}
+#endif
+
+/* Reads one path per line from a batch manifest and appends it to the inputs */
+static int add_manifest_inputs(struct options *opts, const char *manifest, size_t *capacity) {
+  FILE *file = fopen(manifest, "r");
+  if (!file) {
+    fprintf(stderr, "Error opening manifest %s: %s\n", manifest, strerror(errno));
+    return -1;
+  }
+  
+  char line[MAX_PATH_LENGTH * 4];
+  while (fgets(line, sizeof(line), file)) {
+    size_t len = strlen(line);
+    while (len > 0 && isspace((unsigned char)line[len - 1])) {
+      line[--len] = '\0';
+    }
+    if (len == 0) continue;
+    
+    if (opts->input_count == *capacity) {
+      *capacity = *capacity ? *capacity * 2 : 16;
+      char **inputs = realloc(opts->inputs, *capacity * sizeof(*inputs));
+      if (!inputs) {
+        fclose(file);
+        perror("Memory allocation failed");
+        return -1;
+      }
+      opts->inputs = inputs;
+    }
+    opts->inputs[opts->input_count] = malloc(len + 1);
+    if (!opts->inputs[opts->input_count]) {
+      fclose(file);
+      perror("Memory allocation failed");
+      return -1;
+    }
+    memcpy(opts->inputs[opts->input_count++], line, len + 1);
+  }
+  
+  fclose(file);
+  return 0;
+}
+
+static void free_options(struct options *opts) {
+  size_t i;
+  for (i = 0; i < opts->input_count; i++) {
+    free(opts->inputs[i]);
+  }
+  free(opts->inputs);
+  opts->inputs = NULL;
+  opts->input_count = 0;
+  free((void *)opts->includes);
+  free((void *)opts->excludes);
+  opts->includes = NULL;
+  opts->excludes = NULL;
+}
+
+/*
+ * Builds the marker set for --markers and --marker: the lines of the file
+ * (or the built-in set) followed by each --marker, in that priority order.
+ * Returns NULL after printing why.
+ */
+static ai2fs_markers *load_markers(const struct options *opts) {
+  const char *texts[AI2FS_MAX_MARKERS];
+  char *lines[AI2FS_MAX_MARKERS];
+  size_t count = 0, owned = 0, i;
+  int too_many = 0;
+  
+  if (opts->marker_file) {
+    FILE *file = fopen(opts->marker_file, "r");
+    if (!file) {
+      fprintf(stderr, "Error opening marker file %s: %s\n", opts->marker_file, strerror(errno));
+      return NULL;
+    }
+    
+    // One marker per line, trailing spaces included; blank lines are skipped
+    char line[AI2FS_MAX_MARKER_LENGTH * 4];
+    while (fgets(line, sizeof(line), file)) {
+      size_t len = strlen(line);
+      if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+      if (len > 0 && line[len - 1] == '\r') line[--len] = '\0';
+      if (len == 0) continue;
+      if (count == AI2FS_MAX_MARKERS) {
+        too_many = 1;
+        break;
+      }
+      lines[owned] = malloc(len + 1);
+      if (!lines[owned]) break;
+      memcpy(lines[owned], line, len + 1);
+      texts[count++] = lines[owned++];
+    }
+    fclose(file);
+  } else {
+    for (i = 0; i < ai2fs_marker_count(MARKERS); i++) {
+      texts[count++] = ai2fs_marker_text(MARKERS, (int)i);
+    }
+  }
+  for (i = 0; i < opts->extra_marker_count; i++) {
+    if (count == AI2FS_MAX_MARKERS) {
+      too_many = 1;
+      break;
+    }
+    texts[count++] = opts->extra_markers[i];
+  }
+  
+  ai2fs_markers *markers = too_many ? NULL : ai2fs_markers_compile(texts, count);
+  if (!markers && (too_many || errno == EINVAL)) {
+    fprintf(stderr, "%s: a marker set needs 1 to %d markers of 2 to %d bytes each\n",
+        PROGRAM_NAME, AI2FS_MAX_MARKERS, AI2FS_MAX_MARKER_LENGTH);
+  } else if (!markers) {
+    perror("Memory allocation failed");
+  }
+  for (i = 0; i < owned; i++) {
+    free(lines[i]);
+  }
+  return markers;
+}
+
+static void print_usage(void) {
+  fprintf(stderr, "Usage: %s [-q] [-j N] [-p N] [--no-mmap] [--no-uring] [--atomic] [--incremental]"
+      " [--first-wins] [--output=tar:FILE] [--stats[=json]] [--max-mem=SIZE] [--max-file-size=SIZE]"
+      " [--markers=FILE] [--marker=TEXT]... [--include=GLOB]... [--exclude=GLOB]... <input_file | ->\n",
+      PROGRAM_NAME);
+  fprintf(stderr, "       %s --batch [-q] [-j N] [--no-mmap] [--atomic] [--incremental]"
+      " [--first-wins] [--output=tar:FILE] [--stats[=json]] [--max-mem=SIZE] [--max-file-size=SIZE]"
+      " [--markers=FILE] [--marker=TEXT]... [--include=GLOB]... [--exclude=GLOB]..."
+      " <input_file | @manifest>...\n", PROGRAM_NAME);
+  fprintf(stderr, "       %s --dry-run [--manifest=json] [--include=GLOB]... [--exclude=GLOB]..."
+      " <input_file>\n", PROGRAM_NAME);
+  fprintf(stderr, "       %s --watch [-q] [--atomic] [--first-wins] [--max-file-size=SIZE] <input_file>\n",
+      PROGRAM_NAME);
+  fprintf(stderr, "       %s --serve=SOCKET [-q] [-j N] [--atomic] [--incremental] [--first-wins]"
+      " [--max-mem=SIZE] [--max-file-size=SIZE] [--workspaces=DIR]\n", PROGRAM_NAME);
+}
+
+/* Parses a byte count with an optional K, M or G suffix (powers of 1024) */
+static int parse_size(const char *text, unsigned long long *size) {
+  char *end;
+  unsigned shift = 0;
+  
+  if (!isdigit((unsigned char)*text)) return -1;
+  errno = 0;
+  unsigned long long n = strtoull(text, &end, 10);
+  switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    default: break;
+  }
+  if (errno != 0 || *end != '\0' || n > (~0ULL >> shift)) return -1;
+  *size = n << shift;
+  return 0;
+}
+
+/* Parses argv into opts; inputs are copied so manifest entries can join them */
+static int parse_options(int argc, char *argv[], struct options *opts) {
+  size_t capacity = 0;
+  int i;
+  
+  memset(opts, 0, sizeof(*opts));
+  opts->use_mmap = 1;
+  opts->use_uring = 1;
+  
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--no-mmap") == 0) {
+      opts->use_mmap = 0;
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      opts->batch = 1;
+    } else if (strcmp(argv[i], "--incremental") == 0) {
+      opts->incremental = 1;
+    } else if (strcmp(argv[i], "--no-uring") == 0) {
+      opts->use_uring = 0;
+    } else if (strcmp(argv[i], "--atomic") == 0) {
+      opts->atomic = 1;
+    } else if (strncmp(argv[i], "--output=", 9) == 0) {
+      if (strncmp(argv[i] + 9, "tar:", 4) != 0 || argv[i][13] == '\0') {
+        fprintf(stderr, "%s: --output expects tar:FILE\n", PROGRAM_NAME);
+        return -1;
+      }
+      opts->archive = argv[i] + 13;
+    } else if (strncmp(argv[i], "--markers=", 10) == 0 && argv[i][10] != '\0') {
+      opts->marker_file = argv[i] + 10;
+    } else if (strncmp(argv[i], "--marker=", 9) == 0) {
+      if (opts->extra_marker_count == AI2FS_MAX_MARKERS) {
+        fprintf(stderr, "%s: at most %d markers\n", PROGRAM_NAME, AI2FS_MAX_MARKERS);
+        return -1;
+      }
+      opts->extra_markers[opts->extra_marker_count++] = argv[i] + 9;
+    } else if (strcmp(argv[i], "-q") == 0 || strcmp(argv[i], "--quiet") == 0) {
+      opts->quiet = 1;
+    } else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=text") == 0) {
+      opts->stats = STATS_TEXT;
+    } else if (strcmp(argv[i], "--stats=json") == 0) {
+      opts->stats = STATS_JSON;
+    } else if ((strncmp(argv[i], "--include=", 10) == 0 && argv[i][10] != '\0') ||
+        (strncmp(argv[i], "--exclude=", 10) == 0 && argv[i][10] != '\0')) {
+      int include = argv[i][2] == 'i';
+      const char ***list = include ? &opts->includes : &opts->excludes;
+      size_t *count = include ? &opts->include_count : &opts->exclude_count;
+      const char **grown = realloc((void *)*list, (*count + 1) * sizeof(*grown));
+      if (!grown) {
+        perror("Memory allocation failed");
+        return -1;
+      }
+      grown[(*count)++] = argv[i] + 10;
+      *list = grown;
+    } else if (strncmp(argv[i], "--serve=", 8) == 0 && argv[i][8] != '\0') {
+      opts->serve = argv[i] + 8;
+    } else if (strncmp(argv[i], "--workspaces=", 13) == 0 && argv[i][13] != '\0') {
+      opts->workspaces = argv[i] + 13;
+    } else if (strcmp(argv[i], "--watch") == 0) {
+      opts->watch = 1;
+    } else if (strcmp(argv[i], "--first-wins") == 0) {
+      opts->first_wins = 1;
+    } else if (strncmp(argv[i], "--max-mem=", 10) == 0) {
+      unsigned long long size;
+      if (parse_size(argv[i] + 10, &size) != 0 || size < STREAM_BUFFER_SIZE) {
+        fprintf(stderr, "%s: --max-mem expects a size of at least 64K\n", PROGRAM_NAME);
+        return -1;
+      }
+      opts->max_mem = size > (size_t)-1 ? (size_t)-1 : (size_t)size;
+    } else if (strncmp(argv[i], "--max-file-size=", 16) == 0) {
+      if (parse_size(argv[i] + 16, &opts->max_file_size) != 0 || opts->max_file_size == 0) {
+        fprintf(stderr, "%s: --max-file-size expects a size such as 512K, 64M or 2G\n", PROGRAM_NAME);
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--dry-run") == 0) {
+      if (!opts->manifest) opts->manifest = MANIFEST_TEXT;
+    } else if (strcmp(argv[i], "--manifest=json") == 0) {
+      opts->manifest = MANIFEST_JSON;
+    } else if (strcmp(argv[i], "--manifest=text") == 0) {
+      opts->manifest = MANIFEST_TEXT;
+    } else if (strncmp(argv[i], "-j", 2) == 0) {
+      const char *value = argv[i][2] ? argv[i] + 2 : (i + 1 < argc ? argv[++i] : "");
+      char *value_end;
+      long n = strtol(value, &value_end, 10);
+      if (*value == '\0' || *value_end != '\0' || n < 1 || n > MAX_WRITERS) {
+        fprintf(stderr, "%s: -j expects a number from 1 to %d\n", PROGRAM_NAME, MAX_WRITERS);
+        return -1;
+      }
+      opts->jobs = (int)n;
+    } else if (strncmp(argv[i], "-p", 2) == 0) {
+      const char *value = argv[i][2] ? argv[i] + 2 : (i + 1 < argc ? argv[++i] : "");
+      char *value_end;
+      long n = strtol(value, &value_end, 10);
+      if (*value == '\0' || *value_end != '\0' || n < 1 || n > MAX_WRITERS) {
+        fprintf(stderr, "%s: -p expects a number from 1 to %d\n", PROGRAM_NAME, MAX_WRITERS);
+        return -1;
+      }
+      opts->parse_jobs = (int)n;
+    } else if (argv[i][0] == '@' && argv[i][1] != '\0') {
+      if (add_manifest_inputs(opts, argv[i] + 1, &capacity) != 0) return -1;
+    } else {
+      if (opts->input_count == capacity) {
+        capacity = capacity ? capacity * 2 : 16;
+        char **inputs = realloc(opts->inputs, capacity * sizeof(*inputs));
+        if (!inputs) {
+          perror("Memory allocation failed");
+          return -1;
+        }
+        opts->inputs = inputs;
+      }
+      size_t len = strlen(argv[i]);
+      opts->inputs[opts->input_count] = malloc(len + 1);
+      if (!opts->inputs[opts->input_count]) {
+        perror("Memory allocation failed");
+        return -1;
+      }
+      memcpy(opts->inputs[opts->input_count++], argv[i], len + 1);
+    }
+  }
+  
+  // A server takes its transcripts from the socket and runs until stopped
+  if (opts->serve) {
+    #ifdef _WIN32
+      fprintf(stderr, "%s: --serve needs Unix sockets\n", PROGRAM_NAME);
+      return -1;
+    #endif
+    if (opts->input_count > 0 || opts->batch || opts->manifest || opts->archive ||
+        opts->stats || opts->parse_jobs > 1) {
+      fprintf(stderr, "%s: --serve takes no inputs and does not apply to %s\n", PROGRAM_NAME,
+          "--batch, --dry-run, --output=tar, --stats or -p");
+      return -1;
+    }
+    return 0;
+  }
+  if (opts->workspaces) {
+    fprintf(stderr, "%s: --workspaces only applies to --serve\n", PROGRAM_NAME);
+    return -1;
+  }
+  
+  if (opts->input_count == 0 || (!opts->batch && opts->input_count != 1)) {
+    print_usage();
+    return -1;
+  }
+  
+  #ifdef AI2FS_NO_STATS
+    if (opts->stats) {
+      fprintf(stderr, "%s: built without --stats support\n", PROGRAM_NAME);
+      return -1;
+    }
+  #endif
+  
+  // Streaming writes content before the whole file is known
+  int streaming = !opts->batch && strcmp(opts->inputs[0], "-") == 0;
+  if ((streaming || opts->watch) &&
+      (opts->jobs > 1 || opts->parse_jobs > 1 || opts->incremental || opts->archive)) {
+    fprintf(stderr, "%s: %s is not supported %s\n", PROGRAM_NAME,
+        opts->jobs > 1 ? "-j" : opts->parse_jobs > 1 ? "-p" :
+        opts->incremental ? "--incremental" : "--output=tar",
+        streaming ? "when streaming stdin" : "with --watch");
+    return -1;
+  }
+  if (opts->watch && (opts->batch || opts->manifest || streaming)) {
+    fprintf(stderr, "%s: --watch needs one input file and does not apply to %s\n", PROGRAM_NAME,
+        opts->batch ? "--batch" : opts->manifest ? "--dry-run" : "-");
+    return -1;
+  }
+  // A dry run lists one file's paths and writes nothing
+  if (opts->manifest && (opts->batch || strcmp(opts->inputs[0], "-") == 0 ||
+      opts->incremental || opts->archive)) {
+    fprintf(stderr, "%s: --dry-run does not apply to %s\n", PROGRAM_NAME,
+        opts->batch ? "--batch" : opts->incremental ? "--incremental" :
+        opts->archive ? "--output=tar" : "-");
+    return -1;
+  }
+  // Batch mode already parses one input per thread
+  if (opts->batch && opts->parse_jobs > 1) {
+    fprintf(stderr, "%s: -p does not apply to --batch; use -j\n", PROGRAM_NAME);
+    return -1;
+  }
+  if (opts->archive && opts->incremental) {
+    fprintf(stderr, "%s: --incremental does not apply to --output=tar\n", PROGRAM_NAME);
+    return -1;
+  }
+  return 0;
+}
+
+double monotonic_seconds(void) {
+  #ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double)count.QuadPart / (double)frequency.QuadPart;
+  #else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+  #endif
+}
+
+/* Processor time used by the process so far, all threads included */
+double cpu_seconds(void) {
+  #ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) return 0.0;
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (double)(k.QuadPart + u.QuadPart) * 1e-7;
+  #else
+    struct timespec ts;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0) return 0.0;
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+  #endif
+}
+
+/* Raises counter to value if it is lower (peak tracking from any thread) */
+void stats_raise(unsigned long long *counter, unsigned long long value) {
+  #ifdef _WIN32
+    LONG64 seen = *(volatile LONG64 *)counter;
+    while ((unsigned long long)seen < value) {
+      LONG64 prior = InterlockedCompareExchange64((volatile LONG64 *)counter, (LONG64)value, seen);
+      if (prior == seen) break;
+      seen = prior;
+    }
+  #else
+    unsigned long long seen = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    while (seen < value &&
+        !__atomic_compare_exchange_n(counter, &seen, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+  #endif
+}
+
+/* Records the time since *wall_start / *cpu_start as a phase and restarts both */
+void stats_phase(const char *name, double *wall_start, double *cpu_start) {
+  if (!STATS.timing || STATS.phase_count == MAX_PHASES) return;
+  
+  double wall = monotonic_seconds();
+  double cpu = cpu_seconds();
+  struct phase_time *phase = &STATS.phases[STATS.phase_count++];
+  phase->name = name;
+  phase->wall = wall - *wall_start;
+  phase->cpu = cpu - *cpu_start;
+  *wall_start = wall;
+  *cpu_start = cpu;
+}
+
+/* Writes text as a quoted JSON string */
+static void print_json_string(FILE *out, const char *text) {
+  const unsigned char *p;
+  
+  fputc('"', out);
+  for (p = (const unsigned char *)text; *p; p++) {
+    if (*p == '"' || *p == '\\') {
+      fprintf(out, "\\%c", *p);
+    } else if (*p < 0x20) {
+      fprintf(out, "\\u%04x", *p);
+    } else {
+      fputc(*p, out);
+    }
+  }
+  fputc('"', out);
+}
+
+/*
+ * Writes the --stats report to stderr, where it cannot mix with the file
+ * list. Call times are summed over threads, so with -j they can exceed
+ * the wall time of the phase they happened in.
+ */
+void print_stats(enum stats_format format, const struct write_totals *totals) {
+  double wall = 0.0, cpu = 0.0;
+  int i;
+  
+  for (i = 0; i < STATS.phase_count; i++) {
+    wall += STATS.phases[i].wall;
+    cpu += STATS.phases[i].cpu;
+  }
+  
+  if (format == STATS_JSON) {
+    fprintf(stderr, "{\"phases\":[");
+    for (i = 0; i < STATS.phase_count; i++) {
+      fprintf(stderr, "%s{\"name\":\"%s\",\"wall_s\":%.6f,\"cpu_s\":%.6f}", i ? "," : "",
+          STATS.phases[i].name, STATS.phases[i].wall, STATS.phases[i].cpu);
+    }
+    fprintf(stderr, "],\"wall_s\":%.6f,\"cpu_s\":%.6f,", wall, cpu);
+    fprintf(stderr, "\"calls\":{\"mkdir\":{\"count\":%llu,\"s\":%.6f},"
+        "\"open\":{\"count\":%llu,\"s\":%.6f},\"write\":{\"count\":%llu,\"s\":%.6f},"
+        "\"stat\":{\"count\":%llu},\"log\":{\"s\":%.6f}},",
+        STATS.mkdirs, STATS.mkdir_ns * 1e-9, STATS.opens, STATS.open_ns * 1e-9,
+        STATS.writes, STATS.write_ns * 1e-9, STATS.stats, STATS.log_ns * 1e-9);
+    fprintf(stderr, "\"bytes_read\":%llu,\"bytes_written\":%llu,\"peak_buffer\":%llu,",
+        STATS.bytes_read, STATS.bytes_written, STATS.peak_buffer);
+    fprintf(stderr, "\"lines\":%llu,\"markers\":{", STATS.lines);
+    for (i = 0; i < (int)ai2fs_marker_count(MARKERS); i++) {
+      fputs(i ? "," : "", stderr);
+      print_json_string(stderr, ai2fs_marker_text(MARKERS, i));
+      fprintf(stderr, ":%llu", STATS.marker_lines[i]);
+    }
+    fprintf(stderr, "},\"files\":{\"created\":%lu,\"updated\":%lu,\"unchanged\":%lu,\"failed\":%lu,"
+        "\"filtered\":%llu,\"repeated\":%llu}}\n", (unsigned long)totals->created,
+        (unsigned long)totals->updated, (unsigned long)totals->unchanged,
+        (unsigned long)totals->failed, STATS.filtered, STATS.repeated);
+    return;
+  }
+  
+  fprintf(stderr, "phase        wall s     cpu s\n");
+  for (i = 0; i < STATS.phase_count; i++) {
+    fprintf(stderr, "%-8s %10.6f %10.6f\n", STATS.phases[i].name, STATS.phases[i].wall,
+        STATS.phases[i].cpu);
+  }
+  fprintf(stderr, "%-8s %10.6f %10.6f\n", "total", wall, cpu);
+  fprintf(stderr, "calls        count      time s\n");
+  fprintf(stderr, "mkdir   %10llu %11.6f\n", STATS.mkdirs, STATS.mkdir_ns * 1e-9);
+  fprintf(stderr, "open    %10llu %11.6f\n", STATS.opens, STATS.open_ns * 1e-9);
+  fprintf(stderr, "write   %10llu %11.6f\n", STATS.writes, STATS.write_ns * 1e-9);
+  fprintf(stderr, "stat    %10llu\n", STATS.stats);
+  fprintf(stderr, "log              %11.6f\n", STATS.log_ns * 1e-9);
+  fprintf(stderr, "bytes read %llu, written %llu, peak buffer %llu\n", STATS.bytes_read,
+      STATS.bytes_written, STATS.peak_buffer);
+  fprintf(stderr, "lines %llu, markers:", STATS.lines);
+  for (i = 0; i < (int)ai2fs_marker_count(MARKERS); i++) {
+    fprintf(stderr, " \"%s\" %llu", ai2fs_marker_text(MARKERS, i), STATS.marker_lines[i]);
+  }
+  fprintf(stderr, "\nfiles %lu created, %lu updated, %lu unchanged, %lu failed, %llu filtered,"
+      " %llu repeated\n", (unsigned long)totals->created, (unsigned long)totals->updated,
+      (unsigned long)totals->unchanged, (unsigned long)totals->failed, STATS.filtered,
+      STATS.repeated);
+}
+
+/* A manifest entry, printed once the next path line (or the end) bounds it */
+struct manifest_entry {
+  char path[MAX_PATH_LENGTH];
+  int marker;
+  unsigned long long line;
+  size_t offset;
+};
+
+static void print_manifest_entry(enum manifest_format format, const struct manifest_entry *entry,
+    size_t end, unsigned long long last_line, size_t index) {
+  unsigned long long length = (unsigned long long)(end - entry->offset);
+  unsigned long long line_count = last_line - entry->line;
+  
+  if (format == MANIFEST_TEXT) {
+    printf("%llu\t%llu\t%llu\t%llu\t%s\n", (unsigned long long)entry->offset, length,
+        entry->line + 1, line_count, entry->path);
+    return;
+  }
+  printf("%s\n  {\"path\":", index ? "," : "");
+  print_json_string(stdout, entry->path);
+  printf(",\"marker\":");
+  print_json_string(stdout, ai2fs_marker_text(MARKERS, entry->marker));
+  printf(",\"line\":%llu,\"offset\":%llu,\"length\":%llu,\"first_line\":%llu,"
+      "\"line_count\":%llu}", entry->line, (unsigned long long)entry->offset, length,
+      entry->line + 1, line_count);
+}
+
+/*
+ * --dry-run: lists the files a transcript would produce, in input order
+ * and including repeated paths, without creating anything. Each entry
+ * gives the path line's number and the content as a byte range and a line
+ * range of the input. Only the classifier runs, over the mapped input.
+ */
+int write_manifest(const struct input_buffer *input, const char *filename,
+    enum manifest_format format, const struct path_filter *filter) {
+  const char *p = input->data;
+  const char *end = input->data + input->size;
+  struct ai2fs_counts counts;
+  struct manifest_entry entry;
+  size_t files = 0, listed = 0;
+  int selected = 0;
+  
+  memset(&counts, 0, sizeof(counts));
+  if (format == MANIFEST_JSON) {
+    printf("{\"input\":");
+    print_json_string(stdout, filename);
+    printf(",\"files\":[");
+  }
+  
+  while (p < end) {
+    const char *newline = memchr(p, '\n', end - p);
+    const char *next = newline ? newline + 1 : end;
+    struct ai2fs_span span;
+    int marker = ai2fs_classify_line(MARKERS, p, next - p, &span);
+    
+    counts.lines++;
+    if (marker != AI2FS_NO_MARKER) {
+      counts.markers[marker]++;
+      if (selected) {
+        print_manifest_entry(format, &entry, p - input->data, counts.lines - 1, listed++);
+      }
+      memcpy(entry.path, p + span.start, span.len);
+      entry.path[span.len] = '\0';
+      entry.marker = marker;
+      entry.line = counts.lines;
+      entry.offset = next - input->data;
+      selected = path_selected(filter, entry.path);
+      if (!selected) stat_add(STATS.filtered, 1);
+      files++;
+    }
+    p = next;
+  }
+  if (selected) {
+    print_manifest_entry(format, &entry, input->size, counts.lines, listed++);
+  }
+  
+  if (format == MANIFEST_JSON) {
+    printf("%s],\"lines\":%llu}\n", listed ? "\n" : "", counts.lines);
+  }
+  count_parse(&counts);
+  fflush(stdout);
+  return ferror(stdout) ? 1 : 0;
+}
+
+#ifdef AI2FS_BENCH
+/*
+ * Benchmark build (-DAI2FS_BENCH): a synthetic transcript generator and a
+ * harness that times the parse and write phases separately, then both
+ * together with files handed to the writers as they are parsed.
+ *
+ *   ai2fs --generate [--files N] [--depth N] [--lines N] [--line-length N]
+ *                    [--tree-density F] [--markers all | i,j,...] [--seed N]
+ *   ai2fs --bench [-j N] [--write-delay-us N] <input_file>
+ *   ai2fs --fuzz [--iterations N] [--seed N] [FILE...]
+ *   ai2fs --classify [--lines N] [--save FILE] [--baseline FILE] [--max-regression PCT]
+ *
+ * --fuzz and --classify hold the libai2fs classifier to a plain reference
+ * copy of the original one: the first for the same answers, the second
+ * for its speed.
+ */
+
+/* xorshift64*, so a seed always generates the same transcript */
+static unsigned long long bench_random(unsigned long long *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+static unsigned bench_below(unsigned long long *state, unsigned bound) {
+  return bound ? (unsigned)(bench_random(state) % bound) : 0;
+}
+
+static int bench_number(const char *value, long min, long max, long *out) {
+  char *end;
+  long n = value ? strtol(value, &end, 10) : 0;
+  if (!value || *value == '\0' || *end != '\0' || n < min || n > max) return -1;
+  *out = n;
+  return 0;
+}
+
+/* Writes "marker path" in the spelling each marker expects */
+static void generate_marker_line(FILE *out, int marker, const char *path) {
+  const char *text = ai2fs_marker_text(MARKERS, marker);
+  int len = (int)strlen(text);
+  while (len > 0 && text[len - 1] == ' ') {
+    len--;
+  }
+  if (strcmp(text, "[ ") == 0) {
+    fprintf(out, "[ %s ]\n", path);
+  } else {
+    fprintf(out, "%.*s %s\n", len, text, path);
+  }
+}
+
+static void generate_tree_preview(FILE *out, unsigned long long *rng, int depth) {
+  static const char *branches[] = { "├── ", "└── ", "│   ├── ", "│   └── ", "|-- " };
+  int lines = 3 + (int)bench_below(rng, 6);
+  int i;
+  
+  fprintf(out, "// Project structure:\n// src/\n");
+  for (i = 0; i < lines; i++) {
+    fprintf(out, "//   %s%s%d%s\n", branches[bench_below(rng, 5)],
+        (int)bench_below(rng, 2) || depth == 0 ? "File" : "dir", i,
+        bench_below(rng, 2) ? ".java" : "/");
+  }
+  fputc('\n', out);
+}
+
+static void generate_body_line(FILE *out, unsigned long long *rng, int line_length) {
+  static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz_(){};=+ .,0123456789";
+  int target = line_length / 2 + (int)bench_below(rng, (unsigned)line_length + 1);
+  int indent = 2 * (int)bench_below(rng, 4);
+  int i;
+  
+  // Some content lines look like comments but never like a path
+  if (bench_below(rng, 20) == 0) {
+    fputs("// note: keep this in sync with the service layer\n", out);
+    return;
+  }
+  for (i = 0; i < indent; i++) {
+    fputc(' ', out);
+  }
+  fputs("value", out);
+  for (i = indent + 5; i < target; i++) {
+    fputc(alphabet[bench_below(rng, sizeof(alphabet) - 1)], out);
+  }
+  fputc('\n', out);
+}
+
+int generate_main(int argc, char *argv[]) {
+  static const char *extensions[] = { "java", "ts", "py", "json", "md", "yml", "go", "sql" };
+  long files = 1000, depth = 4, lines = 40, line_length = 60, seed = 1;
+  double tree_density = 0.05;
+  int markers[AI2FS_MAX_MARKERS];
+  int kinds = (int)ai2fs_marker_count(MARKERS);
+  int marker_count = 0;
+  int i;
+  
+  for (i = 0; i < kinds; i++) {
+    markers[marker_count++] = i;
+  }
+  
+  for (i = 1; i < argc; i++) {
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    int bad = 0;
+    
+    if (strcmp(argv[i], "--files") == 0) {
+      bad = bench_number(value, 1, 100000000L, &files);
+    } else if (strcmp(argv[i], "--depth") == 0) {
+      bad = bench_number(value, 0, 32, &depth);
+    } else if (strcmp(argv[i], "--lines") == 0) {
+      bad = bench_number(value, 0, 100000000L, &lines);
+    } else if (strcmp(argv[i], "--line-length") == 0) {
+      bad = bench_number(value, 8, 1000000L, &line_length);
+    } else if (strcmp(argv[i], "--seed") == 0) {
+      bad = bench_number(value, 0, 0x7fffffffL, &seed);
+    } else if (strcmp(argv[i], "--tree-density") == 0) {
+      tree_density = value ? atof(value) : -1;
+      bad = tree_density < 0 || tree_density > 1;
+    } else if (strcmp(argv[i], "--markers") == 0) {
+      if (!value) {
+        bad = 1;
+      } else if (strcmp(value, "all") != 0) {
+        char list[256];
+        snprintf(list, sizeof(list), "%s", value);
+        marker_count = 0;
+        char *item;
+        for (item = strtok(list, ","); item && !bad; item = strtok(NULL, ",")) {
+          long index;
+          bad = bench_number(item, 0, kinds - 1, &index);
+          if (!bad) markers[marker_count++] = (int)index;
+          if (marker_count == AI2FS_MAX_MARKERS) break;
+        }
+        bad = bad || marker_count == 0;
+      }
+    } else {
+      fprintf(stderr, "%s --generate: unknown option %s\n", PROGRAM_NAME, argv[i]);
+      return 1;
+    }
+    if (bad) {
+      fprintf(stderr, "%s --generate: bad value for %s\n", PROGRAM_NAME, argv[i]);
+      return 1;
+    }
+    i++;
+  }
+  
+  unsigned long long rng = 0x9E3779B97F4A7C15ULL ^ (unsigned long long)seed;
+  char path[MAX_PATH_LENGTH];
+  long f;
+  
+  for (f = 0; f < files; f++) {
+    if (bench_below(&rng, 1000000) < (unsigned)(tree_density * 1000000)) {
+      generate_tree_preview(stdout, &rng, (int)depth);
+    }
+    
+    // Files spread over a few directories per level, at a random depth
+    int levels = (int)bench_below(&rng, (unsigned)depth + 1);
+    int used = 0;
+    int level;
+    for (level = 0; level < levels; level++) {
+      used += snprintf(path + used, sizeof(path) - used, "d%u/", bench_below(&rng, 4));
+    }
+    snprintf(path + used, sizeof(path) - used, "File%ld.%s", f,
+        extensions[bench_below(&rng, sizeof(extensions) / sizeof(extensions[0]))]);
+    
+    generate_marker_line(stdout, markers[f % marker_count], path);
+    for (i = 0; i < lines; i++) {
+      generate_body_line(stdout, &rng, (int)line_length);
+    }
+    fputc('\n', stdout);
+  }
+  return ferror(stdout) ? 1 : 0;
+}
+
+/* Parse phase: classify every line and record each file's path and slice */
+static size_t bench_parse(const struct input_buffer *input, struct write_job **jobs_out,
+    size_t *lines_out, size_t *markers_by_kind) {
+  struct write_job *jobs = NULL;
+  size_t count = 0, capacity = 0, lines = 0;
+  const char *p = input->data;
+  const char *end = input->data + input->size;
+  
+  while (p < end) {
+    const char *newline = memchr(p, '\n', end - p);
+    const char *next = newline ? newline + 1 : end;
+    struct ai2fs_span span;
+    int marker = ai2fs_classify_line(MARKERS, p, next - p, &span);
+    
+    lines++;
+    if (marker != AI2FS_NO_MARKER) {
+      markers_by_kind[marker]++;
+      if (count > 0) {
+        jobs[count - 1].size = p - jobs[count - 1].data;
+      }
+      if (count == capacity) {
+        capacity = capacity ? capacity * 2 : 1024;
+        struct write_job *grown = realloc(jobs, capacity * sizeof(*jobs));
+        if (!grown) break;
+        jobs = grown;
+      }
+      memcpy(jobs[count].path, p + span.start, span.len);
+      jobs[count].path[span.len] = '\0';
+      jobs[count].data = next;
+      jobs[count].size = 0;
+      count++;
+    }
+    p = next;
+  }
+  if (count > 0) {
+    jobs[count - 1].size = end - jobs[count - 1].data;
+  }
+  
+  *jobs_out = jobs;
+  *lines_out = lines;
+  return count;
+}
 
-/* Constants */
-#define PROGRAM_NAME "ai2fs"
-#define ROOT_FOLDER "generated-code"
-#define MAX_LINE_LENGTH 4096
-#define MAX_PATH_LENGTH 256
+int bench_main(int argc, char *argv[]) {
+  const char *filename = NULL;
+  long jobs = 1;
+  int i;
+  
+  for (i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "-j", 2) == 0) {
+      const char *value = argv[i][2] ? argv[i] + 2 : (i + 1 < argc ? argv[++i] : NULL);
+      if (bench_number(value, 1, MAX_WRITERS, &jobs) != 0) {
+        fprintf(stderr, "%s: -j expects a number from 1 to %d\n", PROGRAM_NAME, MAX_WRITERS);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--write-delay-us") == 0) {
+      if (bench_number(i + 1 < argc ? argv[++i] : NULL, 0, 1000000L, &BENCH_WRITE_DELAY_US) != 0) {
+        fprintf(stderr, "%s: --write-delay-us expects a number from 0 to 1000000\n", PROGRAM_NAME);
+        return 1;
+      }
+    } else {
+      filename = argv[i];
+    }
+  }
+  if (!filename) {
+    fprintf(stderr, "Usage: %s --bench [-j N] [--write-delay-us N] <input_file>\n", PROGRAM_NAME);
+    return 1;
+  }
+  
+  struct input_buffer input = {0};
+  if (load_input(filename, 1, &input) != 0) {
+    perror("Error opening input file");
+    return 1;
+  }
+  
+  size_t markers_by_kind[AI2FS_MAX_MARKERS] = {0};
+  struct write_job *blocks = NULL;
+  size_t lines = 0;
+  double start = monotonic_seconds();
+  size_t files = bench_parse(&input, &blocks, &lines, markers_by_kind);
+  double parse_time = monotonic_seconds() - start;
+  
+  struct dir_cache dirs = {0};
+  struct write_totals totals = {0};
+  struct output out = { ROOT_FOLDER, &dirs, 0, &totals, 1, NULL, 0, NULL, NULL, NULL, 0, NULL, NULL, 0 };
+  struct writer_pool pool;
+  struct writer_pool *writers = NULL;
+  mutex_init(&totals.lock);
+  
+  start = monotonic_seconds();
+  if (jobs > 1 && writer_pool_start(&pool, (int)jobs, &dirs) == 0) {
+    writers = &pool;
+  }
+  size_t f;
+  for (f = 0; f < files; f++) {
+    emit_file(writers, &out, blocks[f].path, blocks[f].data, blocks[f].size, 0);
+  }
+  writer_pool_finish(writers);
+  double write_time = monotonic_seconds() - start;
+  unsigned long long stalls = STATS.writer_stalls;
+  unsigned long long written = STATS.bytes_written, mkdirs = STATS.mkdirs, opens = STATS.opens;
+  unsigned long long stat_calls = STATS.stats, writes = STATS.writes;
+  
+  // Again with each file queued as soon as it is parsed, into fresh directories
+  static const struct ai2fs_callbacks callbacks = { input_begin, input_data, input_end };
+  struct output pipelined = out;
+  pipelined.root = ROOT_FOLDER "/pipelined";
+  start = monotonic_seconds();
+  writers = NULL;
+  if (jobs > 1 && writer_pool_start(&pool, (int)jobs, &dirs) == 0) {
+    writers = &pool;
+  }
+  struct input_file file = { writers, &pipelined, NULL, {0}, NULL, 0 };
+  ai2fs_parse(MARKERS, input.data, input.size, &callbacks, &file, NULL);
+  writer_pool_finish(writers);
+  double pipeline_time = monotonic_seconds() - start;
+  
+  double mb = (double)input.size / (1024.0 * 1024.0);
+  double written_mb = (double)written / (1024.0 * 1024.0);
+  printf("input        %s (%.1f MB, %lu lines, %lu files)\n", filename, mb,
+      (unsigned long)lines, (unsigned long)files);
+  printf("scanner      %s\n", ai2fs_scanner_name(MARKERS));
+  printf("parse        %.3f s  %.0f lines/s  %.1f MB/s  %.0f files/s\n", parse_time,
+      lines / parse_time, mb / parse_time, files / parse_time);
+  printf("write (-j %ld) %.3f s  %.0f files/s  %.1f MB/s  %llu stalls\n", jobs, write_time,
+      files / write_time, written_mb / write_time, stalls);
+  printf("pipelined    %.3f s  (parse then write %.3f s)\n", pipeline_time, parse_time + write_time);
+  printf("syscalls     mkdir %llu  open %llu  stat %llu  write %llu\n", mkdirs, opens, stat_calls,
+      writes);
+  printf("failed       %lu\n", (unsigned long)totals.failed);
+  printf("markers     ");
+  for (i = 0; i < (int)ai2fs_marker_count(MARKERS); i++) {
+    printf(" \"%s\" %lu", ai2fs_marker_text(MARKERS, i), (unsigned long)markers_by_kind[i]);
+  }
+  printf("\n");
+  
+  mutex_destroy(&totals.lock);
+  free(blocks);
+  free_dir_cache(&dirs);
+  release_input(&input);
+  return totals.failed ? 1 : 0;
+}
 
-/* Global variables */
-static const char *PATH_MARKERS[] = {
+/*
+ * Reference classifier for --fuzz and --classify: is_path_line() and
+ * extract_path() as they stood before the marker DFA and the vector line
+ * scanner, quirks included. A "#  " marker matches on "# " alone, a path
+ * loses one closing ']', and paths are cut to MAX_PATH_LENGTH - 1 bytes
+ * before they are trimmed. Whatever libai2fs does to go faster, it has to
+ * classify every line exactly as these do.
+ */
+static const char *REFERENCE_MARKERS[] = {
   "// ", "#  ", "-->", "->", "=> ", "> ", "[ ", "- ", "***", "---", "## ",
   NULL
 };
 
-/* Function declarations */
-void trim(char *str);
-int is_path_line(const char *line);
-void extract_path(const char *line, char *path);
-void create_directories(const char *path);
-
-/* Function implementations */
-void trim(char *str) {
+static void reference_trim(char *str) {
   if (!str) return;
   
   char *end;
@@ -99,209 +5368,874 @@ void trim(char *str) {
   end[1] = '\0';
 }
 
-int is_path_line(const char *line) {
+static size_t reference_trimmed_length(const char *line, size_t len) {
+  while (len > 0 && isspace((unsigned char)line[len - 1])) {
+    len--;
+  }
+  return len;
+}
+
+static int reference_span_contains(const char *str, size_t len, const char *needle) {
+  size_t needle_len = strlen(needle);
+  const char *p = str;
+  const char *end = str + len;
+  
+  while (needle_len <= (size_t)(end - p) &&
+      (p = memchr(p, needle[0], end - p - needle_len + 1)) != NULL) {
+    if (memcmp(p, needle, needle_len) == 0) return 1;
+    p++;
+  }
+  return 0;
+}
+
+/* Offset of the path after the leading marker, or 0; marker receives its index */
+static size_t reference_marker_offset(const char *line, size_t len, int *marker) {
+  int i;
+  
+  for (i = 0; REFERENCE_MARKERS[i] != NULL; i++) {
+    size_t marker_len = strlen(REFERENCE_MARKERS[i]);
+    if (len >= marker_len - 1 && memcmp(line, REFERENCE_MARKERS[i], marker_len - 1) == 0) {
+      *marker = i;
+      return strchr(REFERENCE_MARKERS[i], ' ') ? marker_len - 1 : marker_len;
+    }
+  }
+  *marker = AI2FS_NO_MARKER;
+  return 0;
+}
+
+static int reference_is_path_line(const char *line, size_t len) {
   if (!line) return 0;
   
-  char trimmed[MAX_LINE_LENGTH];
-  strncpy(trimmed, line, MAX_LINE_LENGTH - 1);
-  trimmed[MAX_LINE_LENGTH - 1] = '\0';
-  trim(trimmed);
+  len = reference_trimmed_length(line, len);
   
   // Must not be empty
-  if (trimmed[0] == '\0') return 0;
-
+  if (len == 0) return 0;
+  
   // Skip directory structure lines
-  if (strstr(trimmed, "├") || 
-    strstr(trimmed, "└") || 
-    strstr(trimmed, "│") ||
-    strstr(trimmed, "|--")) {
+  if (reference_span_contains(line, len, "├") ||
+    reference_span_contains(line, len, "└") ||
+    reference_span_contains(line, len, "│") ||
+    reference_span_contains(line, len, "|--")) {
     return 0;
   }
-
-  // Check if line starts with any of our markers
-  const char **marker;
-  const char *path_start = NULL;
   
-  for (marker = PATH_MARKERS; *marker != NULL; marker++) {
-    size_t marker_len = strlen(*marker);
-    if (strncmp(trimmed, *marker, marker_len - 1) == 0) {
-      path_start = trimmed + (strchr(*marker, ' ') ? marker_len - 1 : marker_len);
-      break;
-    }
-  }
+  // Check if line starts with any of our markers
+  int marker;
+  size_t path_start = reference_marker_offset(line, len, &marker);
+  if (path_start == 0 || path_start > len) return 0;
   
-  if (!path_start) return 0;
-
   // Skip any remaining spaces after marker
-  while (isspace((unsigned char)*path_start)) {
+  while (path_start < len && isspace((unsigned char)line[path_start])) {
     path_start++;
   }
   
   // Must have content after marker
-  if (*path_start == '\0') return 0;
+  if (path_start == len) return 0;
   
   // Must have a file extension
-  const char *last_dot = strrchr(path_start, '.');
-  return (last_dot && *(last_dot + 1) != '\0');
+  const char *p = line + len;
+  while (p > line + path_start && p[-1] != '.') {
+    p--;
+  }
+  return (p > line + path_start && p < line + len);
 }
 
-void extract_path(const char *line, char *path) {
+static void reference_extract_path(const char *line, size_t len, char *path) {
   if (!line || !path) return;
   
-  char trimmed[MAX_LINE_LENGTH];
-  strncpy(trimmed, line, MAX_LINE_LENGTH - 1);
-  trimmed[MAX_LINE_LENGTH - 1] = '\0';
-  trim(trimmed);
+  len = reference_trimmed_length(line, len);
   
   // Find which marker was used
-  const char **marker;
-  const char *path_start = NULL;
-  
-  for (marker = PATH_MARKERS; *marker != NULL; marker++) {
-    size_t marker_len = strlen(*marker);
-    if (strncmp(trimmed, *marker, marker_len - 1) == 0) {
-      path_start = trimmed + (strchr(*marker, ' ') ? marker_len - 1 : marker_len);
-      break;
-    }
-  }
-  
-  if (!path_start) {
+  int marker;
+  size_t path_start = reference_marker_offset(line, len, &marker);
+  if (path_start == 0 || path_start > len) {
     path[0] = '\0';
     return;
   }
   
   // Skip any remaining spaces
-  while (isspace((unsigned char)*path_start)) {
+  while (path_start < len && isspace((unsigned char)line[path_start])) {
     path_start++;
   }
   
   // Copy the path
-  strncpy(path, path_start, MAX_PATH_LENGTH - 1);
-  path[MAX_PATH_LENGTH - 1] = '\0';
-  trim(path);
+  size_t path_len = len - path_start;
+  if (path_len > MAX_PATH_LENGTH - 1) {
+    path_len = MAX_PATH_LENGTH - 1;
+  }
+  memcpy(path, line + path_start, path_len);
+  path[path_len] = '\0';
+  reference_trim(path);
   
   // Remove closing bracket if present
-  size_t len = strlen(path);
-  if (len > 0 && path[len - 1] == ']') {
-    path[len - 1] = '\0';
-    trim(path);
+  path_len = strlen(path);
+  if (path_len > 0 && path[path_len - 1] == ']') {
+    path[path_len - 1] = '\0';
+    reference_trim(path);
   }
 }
 
-void create_directories(const char *path) {
-  if (!path) return;
+/* Prints a line with bytes outside printable ASCII escaped */
+static void fuzz_print_line(const char *label, const char *line, size_t len) {
+  size_t i;
   
-  char temp[MAX_PATH_LENGTH];
-  char *p;
+  fprintf(stderr, "  %-10s \"", label);
+  for (i = 0; i < len; i++) {
+    unsigned char c = (unsigned char)line[i];
+    if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\') {
+      fputc(c, stderr);
+    } else {
+      fprintf(stderr, "\\x%02x", c);
+    }
+  }
+  fprintf(stderr, "\"\n");
+}
+
+/*
+ * Holds one line to the reference: the same verdict, marker and path, and
+ * a first byte the prefilter lets through. The reference copies the path
+ * as a C string, so for a line holding a NUL it is no spec past that
+ * byte; only the verdict and marker are compared there.
+ */
+static int fuzz_check_line(const char *line, size_t len) {
+  struct ai2fs_span span;
+  char path[MAX_PATH_LENGTH];
+  char expected[MAX_PATH_LENGTH];
+  int expected_marker = AI2FS_NO_MARKER;
   
-  // First create the root folder
-  #ifdef _WIN32
-    _mkdir(ROOT_FOLDER);
-  #else
-    mkdir(ROOT_FOLDER, S_IRWXU);
-  #endif
+  int reference = reference_is_path_line(line, len);
+  int marker = ai2fs_classify_line(MARKERS, line, len, &span);
+  if (reference) reference_marker_offset(line, reference_trimmed_length(line, len), &expected_marker);
   
-  // Prepend root folder to path
-  snprintf(temp, sizeof(temp), "%s/%s", ROOT_FOLDER, path);
+  const char *problem = NULL;
+  if ((marker != AI2FS_NO_MARKER) != reference) {
+    problem = reference ? "missed a path line" : "took content for a path line";
+  } else if (reference && marker != expected_marker) {
+    problem = "matched another marker";
+  } else if (reference && !ai2fs_may_start_marker(MARKERS, (unsigned char)line[0])) {
+    problem = "prefilter rejected a path line";
+  } else if (reference && !memchr(line, '\0', len)) {
+    reference_extract_path(line, len, expected);
+    memcpy(path, line + span.start, span.len);
+    path[span.len] = '\0';
+    if (strcmp(path, expected) != 0) problem = "extracted another path";
+  }
+  if (!problem) return 0;
   
-  for (p = temp + 1; *p; p++) {
-    if (*p == '/') {
-      *p = '\0';
-      #ifdef _WIN32
-        _mkdir(temp);
-      #else
-        mkdir(temp, S_IRWXU);
-      #endif
-      *p = '/';
+  fprintf(stderr, "%s: classifier %s\n", PROGRAM_NAME, problem);
+  fuzz_print_line("line", line, len);
+  if (reference) {
+    reference_extract_path(line, len, expected);
+    fuzz_print_line("reference", expected, strlen(expected));
+  }
+  if (marker != AI2FS_NO_MARKER) fuzz_print_line("libai2fs", line + span.start, span.len);
+  return -1;
+}
+
+/* A parse written down as path, NUL, content length and content, file after file */
+struct fuzz_sink {
+  char *data;
+  size_t size;
+  size_t capacity;
+  size_t file_start;
+  int failed;
+};
+
+static void fuzz_put(struct fuzz_sink *sink, const void *data, size_t len) {
+  if (sink->size + len > sink->capacity) {
+    size_t capacity = sink->capacity ? sink->capacity : 4096;
+    while (capacity < sink->size + len) {
+      capacity *= 2;
     }
+    char *grown = realloc(sink->data, capacity);
+    if (!grown) {
+      sink->failed = 1;
+      return;
+    }
+    sink->data = grown;
+    sink->capacity = capacity;
   }
+  memcpy(sink->data + sink->size, data, len);
+  sink->size += len;
 }
 
-int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s <input_file>\n", PROGRAM_NAME);
-    return 1;
+static int fuzz_begin(void *context, const char *path, int marker) {
+  struct fuzz_sink *sink = context;
+  unsigned long long length = 0;
+  
+  (void)marker;
+  fuzz_put(sink, path, strlen(path) + 1);
+  sink->file_start = sink->size;
+  fuzz_put(sink, &length, sizeof(length));
+  return 0;
+}
+
+static int fuzz_data(void *context, const char *data, size_t len) {
+  fuzz_put(context, data, len);
+  return 0;
+}
+
+static int fuzz_end(void *context) {
+  struct fuzz_sink *sink = context;
+  unsigned long long length = sink->size - sink->file_start - sizeof(length);
+  
+  if (!sink->failed) memcpy(sink->data + sink->file_start, &length, sizeof(length));
+  return 0;
+}
+
+/* Splits text as the first ai2fs did: memchr for lines, the reference for path lines */
+static void fuzz_reference_parse(const char *data, size_t size, struct fuzz_sink *sink) {
+  const char *p = data;
+  const char *end = data + size;
+  int in_file = 0;
+  
+  while (p < end) {
+    const char *newline = memchr(p, '\n', end - p);
+    const char *next = newline ? newline + 1 : end;
+  
+    if (reference_is_path_line(p, next - p)) {
+      char path[MAX_PATH_LENGTH];
+      struct ai2fs_span span;
+      if (in_file) fuzz_end(sink);
+  
+      // Past a NUL the path is the library's; fuzz_check_line() holds the verdict
+      if (memchr(p, '\0', next - p) && ai2fs_classify_line(MARKERS, p, next - p, &span) != AI2FS_NO_MARKER) {
+        memcpy(path, p + span.start, span.len);
+        path[span.len] = '\0';
+      } else {
+        reference_extract_path(p, next - p, path);
+      }
+      fuzz_begin(sink, path, 0);
+      in_file = 1;
+    } else if (in_file) {
+      fuzz_data(sink, p, next - p);
+    }
+    p = next;
   }
+  if (in_file) fuzz_end(sink);
+}
+
+/*
+ * Checks one input: every line with and without its newline, then the
+ * files that ai2fs_parse() and the push parser (fed in pieces of 1 to 64
+ * bytes, cut by seed) make of the whole text against the reference split.
+ */
+static int fuzz_check_input(const char *data, size_t size, unsigned long long seed) {
+  static const struct ai2fs_callbacks callbacks = { fuzz_begin, fuzz_data, fuzz_end };
+  struct fuzz_sink expected = {0}, parsed = {0}, pushed = {0};
+  const char *p = data;
+  const char *end = data + size;
+  int status = 0;
   
-  FILE *input_file = fopen(argv[1], "r");
-  if (!input_file) {
-    perror("Error opening input file");
+  while (p < end && status == 0) {
+    const char *newline = memchr(p, '\n', end - p);
+    const char *next = newline ? newline + 1 : end;
+    status = fuzz_check_line(p, next - p);
+    if (status == 0 && newline) status = fuzz_check_line(p, newline - p);
+    p = next;
+  }
+  
+  if (status == 0) {
+    fuzz_reference_parse(data, size, &expected);
+    ai2fs_parse(MARKERS, data, size, &callbacks, &parsed, NULL);
+  
+    ai2fs_parser *parser = ai2fs_parser_new(MARKERS, &callbacks, &pushed);
+    size_t offset = 0;
+    while (parser && offset < size) {
+      size_t piece = 1 + bench_below(&seed, 64);
+      if (piece > size - offset) piece = size - offset;
+      if (ai2fs_parser_feed(parser, data + offset, piece) != 0) break;
+      offset += piece;
+    }
+    if (parser) ai2fs_parser_finish(parser);
+    ai2fs_parser_free(parser);
+  
+    if (expected.failed || parsed.failed || pushed.failed || !parser || offset < size) {
+      fprintf(stderr, "%s: out of memory while checking\n", PROGRAM_NAME);
+      status = -1;
+    } else if (parsed.size != expected.size ||
+        (expected.size > 0 && memcmp(parsed.data, expected.data, expected.size) != 0)) {
+      fprintf(stderr, "%s: ai2fs_parse() split the text differently from the reference\n", PROGRAM_NAME);
+      status = -1;
+    } else if (pushed.size != expected.size ||
+        (expected.size > 0 && memcmp(pushed.data, expected.data, expected.size) != 0)) {
+      fprintf(stderr, "%s: the push parser split the text differently from the reference\n", PROGRAM_NAME);
+      status = -1;
+    }
+  }
+  
+  free(expected.data);
+  free(parsed.data);
+  free(pushed.data);
+  return status;
+}
+
+/*
+ * A random transcript for --fuzz, built from the pieces the classifier
+ * cares about: markers and their prefixes, tree glyphs whole and cut,
+ * every kind of whitespace, dots, brackets, raw bytes, and runs long
+ * enough to cross the path length limit.
+ */
+static size_t fuzz_generate(unsigned long long *rng, char *out, size_t capacity) {
+  static const char *const pieces[] = {
+    "// ", "//", "/", "#  ", "# ", "#", "## ", "##", "-->", "--", "->", "-", "- ", "=> ", "=>",
+    "=", "> ", ">", "[ ", "[", "]", " ]", "***", "**", "*", "---", "├── ", "└── ", "│   ",
+    "├", "\xe2\x94", "\xe2", "|--", "|-", "|", " ", "  ", "\t", "\r", "\v", "\f", ".", "..",
+    "a.c", "src/", "main", ".java", "x", "\xc3\xa9", "File1.ts"
+  };
+  size_t count = sizeof(pieces) / sizeof(pieces[0]);
+  size_t size = 0;
+  unsigned lines = 1 + bench_below(rng, 24);
+  unsigned l;
+  
+  for (l = 0; l < lines; l++) {
+    unsigned parts = bench_below(rng, 9);
+    unsigned k;
+  
+    // Most lines open with a marker, as the interesting ones do
+    if (bench_below(rng, 10) < 7 && size + 4 < capacity) {
+      const char *marker = REFERENCE_MARKERS[bench_below(rng, 11)];
+      memcpy(out + size, marker, strlen(marker));
+      size += strlen(marker);
+    }
+    for (k = 0; k < parts; k++) {
+      unsigned kind = bench_below(rng, 40);
+      if (kind == 0) {
+        unsigned run = MAX_PATH_LENGTH - 8 + bench_below(rng, 16);
+        if (size + run >= capacity) break;
+        memset(out + size, bench_below(rng, 2) ? 'x' : ' ', run);
+        size += run;
+      } else if (kind < 4) {
+        if (size + 1 >= capacity) break;
+        out[size++] = (char)bench_below(rng, 256);
+      } else {
+        const char *piece = pieces[bench_below(rng, (unsigned)count)];
+        size_t len = strlen(piece);
+        if (size + len >= capacity) break;
+        memcpy(out + size, piece, len);
+        size += len;
+      }
+    }
+    if (size + 2 >= capacity) break;
+    if (l + 1 < lines || bench_below(rng, 2)) {
+      if (bench_below(rng, 8) == 0) out[size++] = '\r';
+      out[size++] = '\n';
+    }
+  }
+  return size;
+}
+
+/*
+ * --fuzz: differential test of libai2fs against the reference. Given
+ * files (as AFL passes its @@), each is checked once; otherwise N random
+ * transcripts are. The first difference is printed and fails the run.
+ */
+int fuzz_main(int argc, char *argv[]) {
+  long iterations = 100000, seed = 1;
+  int files = 0;
+  int i;
+  
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--iterations") == 0 || strcmp(argv[i], "--seed") == 0) {
+      long *target = argv[i][2] == 'i' ? &iterations : &seed;
+      if (bench_number(i + 1 < argc ? argv[i + 1] : NULL, 0, 0x7fffffffL, target) != 0) {
+        fprintf(stderr, "%s --fuzz: bad value for %s\n", PROGRAM_NAME, argv[i]);
+        return 1;
+      }
+      i++;
+      continue;
+    }
+  
+    struct input_buffer input = {0};
+    files++;
+    if (load_input(argv[i], 0, &input) != 0) {
+      fprintf(stderr, "Error opening input file %s: %s\n", argv[i], strerror(errno));
+      release_input(&input);
+      return 1;
+    }
+    int status = fuzz_check_input(input.data, input.size, hash_bytes(input.data, input.size));
+    release_input(&input);
+    if (status != 0) {
+      fprintf(stderr, "%s: in %s\n", PROGRAM_NAME, argv[i]);
+      return 1;
+    }
+  }
+  if (files > 0) return 0;
+  
+  char *text = malloc(1 << 16);
+  if (!text) {
+    perror("Memory allocation failed");
     return 1;
   }
+  unsigned long long rng = 0x9E3779B97F4A7C15ULL ^ (unsigned long long)seed;
+  long n;
+  for (n = 0; n < iterations; n++) {
+    size_t size = fuzz_generate(&rng, text, 1 << 16);
+    if (fuzz_check_input(text, size, rng) != 0) {
+      fprintf(stderr, "%s: in transcript %ld of --seed %ld\n", PROGRAM_NAME, n, seed);
+      free(text);
+      return 1;
+    }
+  }
+  free(text);
+  printf("fuzz         %ld transcripts, no differences (scanner %s)\n", iterations,
+      ai2fs_scanner_name(MARKERS));
+  return 0;
+}
+
+/* One --classify row: a pool of lines of one kind, and its timings */
+struct classify_row {
+  char key[32];
+  char label[32];
+  char *text;
+  size_t size;
+  size_t lines;
+  double reference_ns;
+  double fast_ns;
+};
+
+/* Loads whatever write_lines() produced through a temporary file into row */
+static int classify_pool(struct classify_row *row, FILE *file) {
+  long size = ftell(file);
+  
+  row->text = size > 0 ? malloc((size_t)size) : NULL;
+  if (!row->text) return -1;
+  rewind(file);
+  row->size = fread(row->text, 1, (size_t)size, file);
+  row->lines = 0;
+  const char *p = row->text;
+  const char *end = row->text + row->size;
+  while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+    row->lines++;
+    p++;
+  }
+  return row->size == (size_t)size ? 0 : -1;
+}
+
+static volatile size_t BENCH_SINK;
+
+/* Nanoseconds per line to classify a pool, best of a few runs of about 50 ms */
+static double classify_time(const struct classify_row *row, int reference) {
+  double best = 0;
+  int round;
   
-  char line[MAX_LINE_LENGTH];
-  char current_path[MAX_PATH_LENGTH] = {0};
-  FILE *output_file = NULL;
-  char *content_buffer = NULL;
-  size_t content_size = 0;
-  size_t content_capacity = 0;
+  for (round = 0; round < 5; round++) {
+    size_t passes = 0, found = 0;
+    double start = monotonic_seconds(), elapsed;
+    do {
+      const char *p = row->text;
+      const char *end = row->text + row->size;
+      while (p < end) {
+        const char *newline = memchr(p, '\n', end - p);
+        const char *next = newline ? newline + 1 : end;
+        if (reference) {
+          char path[MAX_PATH_LENGTH];
+          if (reference_is_path_line(p, next - p)) {
+            reference_extract_path(p, next - p, path);
+            found += (unsigned char)path[0];
+          }
+        } else {
+          struct ai2fs_span span;
+          if (ai2fs_classify_line(MARKERS, p, next - p, &span) != AI2FS_NO_MARKER) {
+            found += (unsigned char)p[span.start];
+          }
+        }
+        p = next;
+      }
+      passes++;
+      elapsed = monotonic_seconds() - start;
+    } while (elapsed < 0.05);
+    BENCH_SINK += found;
   
-  printf("Root folder '%s' created.\n", ROOT_FOLDER);
+    double ns = elapsed * 1e9 / ((double)passes * (double)row->lines);
+    if (round == 0 || ns < best) best = ns;
+  }
+  return best;
+}
+
+/* Last row of --classify: whole transcripts, reference split against ai2fs_parse() */
+static double parse_time(const struct classify_row *row, int reference) {
+  static const struct ai2fs_callbacks callbacks = { NULL, NULL, NULL };
+  double best = 0;
+  int round;
   
-  while (fgets(line, sizeof(line), input_file)) {
-    if (is_path_line(line)) {
-      // If we were collecting content, save it
-      if (output_file) {
-        if (content_buffer) {
-          fputs(content_buffer, output_file);
-          free(content_buffer);
-          content_buffer = NULL;
+  for (round = 0; round < 5; round++) {
+    size_t passes = 0;
+    double start = monotonic_seconds(), elapsed;
+    do {
+      if (reference) {
+        const char *p = row->text;
+        const char *end = row->text + row->size;
+        size_t found = 0;
+        while (p < end) {
+          const char *newline = memchr(p, '\n', end - p);
+          const char *next = newline ? newline + 1 : end;
+          if (reference_is_path_line(p, next - p)) {
+            char path[MAX_PATH_LENGTH];
+            reference_extract_path(p, next - p, path);
+            found++;
+          }
+          p = next;
         }
-        fclose(output_file);
-        printf("Created file: %s\n", current_path);
+        BENCH_SINK += found;
+      } else {
+        ai2fs_parse(MARKERS, row->text, row->size, &callbacks, NULL, NULL);
       }
-      
-      // Extract and process new path
-      extract_path(line, current_path);
-      create_directories(current_path);
-      
-      // Open new file
-      char full_path[MAX_PATH_LENGTH];
-      snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_FOLDER, current_path);
-      output_file = fopen(full_path, "w");
-      if (!output_file) {
-        fprintf(stderr, "Error creating file %s: %s\n", 
-            full_path, strerror(errno));
-        continue;
+      passes++;
+      elapsed = monotonic_seconds() - start;
+    } while (elapsed < 0.05);
+  
+    double ns = elapsed * 1e9 / ((double)passes * (double)row->lines);
+    if (round == 0 || ns < best) best = ns;
+  }
+  return best;
+}
+
+/*
+ * --classify: ns/line for the reference and for libai2fs, one row per
+ * marker, plus content lines, tree previews and a whole transcript.
+ * --save writes the libai2fs times; --baseline fails the run when any row
+ * is more than --max-regression percent (10 by default) slower than the
+ * saved one.
+ */
+int classify_main(int argc, char *argv[]) {
+  const char *save = NULL, *baseline = NULL;
+  long lines = 20000, max_regression = 10;
+  int i;
+  
+  for (i = 1; i < argc; i++) {
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    int bad = 0;
+  
+    if (strcmp(argv[i], "--lines") == 0) {
+      bad = bench_number(value, 100, 100000000L, &lines);
+    } else if (strcmp(argv[i], "--max-regression") == 0) {
+      bad = bench_number(value, 0, 1000, &max_regression);
+    } else if (strcmp(argv[i], "--save") == 0) {
+      save = value;
+      bad = !value;
+    } else if (strcmp(argv[i], "--baseline") == 0) {
+      baseline = value;
+      bad = !value;
+    } else {
+      fprintf(stderr, "%s --classify: unknown option %s\n", PROGRAM_NAME, argv[i]);
+      return 1;
+    }
+    if (bad) {
+      fprintf(stderr, "%s --classify: bad value for %s\n", PROGRAM_NAME, argv[i]);
+      return 1;
+    }
+    i++;
+  }
+  
+  struct classify_row rows[AI2FS_MAX_MARKERS + 3];
+  int kinds = (int)ai2fs_marker_count(MARKERS);
+  int count = 0;
+  unsigned long long rng = 0x9E3779B97F4A7C15ULL;
+  int status = 0;
+  long n;
+  
+  memset(rows, 0, sizeof(rows));
+  for (i = 0; i < kinds + 3 && status == 0; i++) {
+    struct classify_row *row = &rows[count++];
+    FILE *file = tmpfile();
+    if (!file) {
+      perror("Error creating temporary file");
+      status = 1;
+      break;
+    }
+  
+    if (i < kinds) {
+      snprintf(row->key, sizeof(row->key), "marker%d", i);
+      snprintf(row->label, sizeof(row->label), "\"%s\"", ai2fs_marker_text(MARKERS, i));
+      for (n = 0; n < lines; n++) {
+        char path[64];
+        snprintf(path, sizeof(path), "d%u/d%u/File%ld.java", bench_below(&rng, 4), bench_below(&rng, 4), n);
+        generate_marker_line(file, i, path);
       }
-      
-      // Reset content buffer
-      content_size = 0;
-      content_capacity = MAX_LINE_LENGTH;
-      content_buffer = malloc(content_capacity);
-      if (!content_buffer) {
-        perror("Memory allocation failed");
-        fclose(output_file);
-        return 1;
+    } else if (i == kinds) {
+      snprintf(row->key, sizeof(row->key), "content");
+      snprintf(row->label, sizeof(row->label), "content");
+      for (n = 0; n < lines; n++) {
+        generate_body_line(file, &rng, 60);
       }
-      content_buffer[0] = '\0';
-    } else if (output_file) {
-      // Append to content buffer
-      size_t line_len = strlen(line);
-      while (content_size + line_len + 1 > content_capacity) {
-        content_capacity *= 2;
-        char *new_buffer = realloc(content_buffer, content_capacity);
-        if (!new_buffer) {
-          perror("Memory reallocation failed");
-          free(content_buffer);
-          fclose(output_file);
-          return 1;
+    } else if (i == kinds + 1) {
+      snprintf(row->key, sizeof(row->key), "tree");
+      snprintf(row->label, sizeof(row->label), "tree");
+      while (ftell(file) < lines * 24) {
+        generate_tree_preview(file, &rng, 4);
+      }
+    } else {
+      // About 40 lines a file, every marker in turn, an occasional tree
+      snprintf(row->key, sizeof(row->key), "parse");
+      snprintf(row->label, sizeof(row->label), "transcript");
+      for (n = 0; n < lines / 40 + 1; n++) {
+        char path[64];
+        int line;
+        if (n % 20 == 0) generate_tree_preview(file, &rng, 4);
+        snprintf(path, sizeof(path), "d%u/File%ld.ts", bench_below(&rng, 4), n);
+        generate_marker_line(file, (int)(n % kinds), path);
+        for (line = 0; line < 40; line++) {
+          generate_body_line(file, &rng, 60);
         }
-        content_buffer = new_buffer;
       }
-      strcat(content_buffer, line);
-      content_size += line_len;
     }
+    if (classify_pool(row, file) != 0) {
+      perror("Error reading temporary file");
+      status = 1;
+    }
+    fclose(file);
   }
   
-  // Save last file if we were collecting content
-  if (output_file && content_buffer) {
-    fputs(content_buffer, output_file);
-    free(content_buffer);
-    fclose(output_file);
-    printf("Created file: %s\n", current_path);
+  if (status == 0) {
+    printf("scanner      %s\n", ai2fs_scanner_name(MARKERS));
+    printf("%-12s %9s %9s %8s   (ns/line)\n", "lines", "reference", "libai2fs", "speedup");
+    for (i = 0; i < count; i++) {
+      struct classify_row *row = &rows[i];
+      int whole = strcmp(row->key, "parse") == 0;
+      row->reference_ns = whole ? parse_time(row, 1) : classify_time(row, 1);
+      row->fast_ns = whole ? parse_time(row, 0) : classify_time(row, 0);
+      printf("%-12s %9.2f %9.2f %7.2fx\n", row->label, row->reference_ns, row->fast_ns,
+          row->reference_ns / row->fast_ns);
+    }
+  }
+  
+  if (status == 0 && baseline) {
+    FILE *file = fopen(baseline, "r");
+    char key[32];
+    double ns;
+    if (!file) {
+      perror("Error opening baseline");
+      status = 1;
+    }
+    while (file && fscanf(file, "%31s %lf", key, &ns) == 2) {
+      for (i = 0; i < count; i++) {
+        if (strcmp(rows[i].key, key) == 0 && rows[i].fast_ns > ns * (1.0 + max_regression / 100.0)) {
+          fprintf(stderr, "%s: %s lines are %.0f%% slower than the baseline (%.2f ns, was %.2f)\n",
+              PROGRAM_NAME, rows[i].label, (rows[i].fast_ns / ns - 1.0) * 100.0, rows[i].fast_ns, ns);
+          status = 1;
+        }
+      }
+    }
+    if (file) fclose(file);
+  }
+  if (status == 0 && save) {
+    FILE *file = fopen(save, "w");
+    if (!file) {
+      perror("Error creating baseline");
+      status = 1;
+    }
+    for (i = 0; file && i < count; i++) {
+      fprintf(file, "%s %.3f\n", rows[i].key, rows[i].fast_ns);
+    }
+    if (file && fclose(file) != 0) status = 1;
   }
   
-  fclose(input_file);
+  for (i = 0; i < count; i++) {
+    free(rows[i].text);
+  }
+  return status;
+}
+
+#ifdef AI2FS_FUZZ
+/* libFuzzer entry point (-DAI2FS_FUZZ); the input is one transcript */
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size) {
+  if (!MARKERS && !(MARKERS = ai2fs_markers_new())) return 0;
+  if (fuzz_check_input((const char *)data, size, hash_bytes((const char *)data, size)) != 0) abort();
   return 0;
 }
+#endif
+#endif
+
+int main(int argc, char *argv[]) {
+  struct options opts;
+  struct dir_cache dirs = {0};
+  struct write_totals totals = {0};
+  static struct progress_log progress;
+  int status = 0;
+  
+  MARKERS = ai2fs_markers_new();
+  if (!MARKERS) {
+    perror("Memory allocation failed");
+    return 1;
+  }
+  
+  #ifdef AI2FS_BENCH
+    if (argc > 1 && strcmp(argv[1], "--generate") == 0) {
+      status = generate_main(argc - 1, argv + 1);
+      ai2fs_markers_free(MARKERS);
+      return status;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+      status = bench_main(argc - 1, argv + 1);
+      ai2fs_markers_free(MARKERS);
+      return status;
+    }
+    if (argc > 1 && strcmp(argv[1], "--fuzz") == 0) {
+      status = fuzz_main(argc - 1, argv + 1);
+      ai2fs_markers_free(MARKERS);
+      return status;
+    }
+    if (argc > 1 && strcmp(argv[1], "--classify") == 0) {
+      status = classify_main(argc - 1, argv + 1);
+      ai2fs_markers_free(MARKERS);
+      return status;
+    }
+  #endif
+  
+  if (parse_options(argc, argv, &opts) != 0) {
+    free_options(&opts);
+    ai2fs_markers_free(MARKERS);
+    return 1;
+  }
+  if (opts.marker_file || opts.extra_marker_count > 0) {
+    ai2fs_markers *markers = load_markers(&opts);
+    ai2fs_markers_free(MARKERS);
+    MARKERS = markers;
+    if (!MARKERS) {
+      free_options(&opts);
+      return 1;
+    }
+  }
+  mutex_init(&totals.lock);
+  log_init(&progress);
+  
+  struct output out = { ROOT_FOLDER, &dirs, opts.incremental, &totals, opts.quiet, &progress,
+      opts.atomic, NULL, NULL, NULL, opts.first_wins, NULL, NULL, opts.max_file_size };
+  struct path_filter filter;
+  if (path_filter_init(&filter, &opts) != 0) {
+    perror("Memory allocation failed");
+    log_destroy(&progress);
+    mutex_destroy(&totals.lock);
+    free_options(&opts);
+    ai2fs_markers_free(MARKERS);
+    return 1;
+  }
+  if (opts.include_count > 0 || opts.exclude_count > 0) out.filter = &filter;
+  
+  struct tar_sink archive;
+  if (opts.archive) {
+    if (tar_open(&archive, opts.archive, opts.atomic) != 0) {
+      fprintf(stderr, "Error creating archive %s: %s\n", opts.archive, strerror(errno));
+      log_destroy(&progress);
+      mutex_destroy(&totals.lock);
+      path_filter_free(&filter);
+      free_options(&opts);
+      ai2fs_markers_free(MARKERS);
+      return 1;
+    }
+    out.tar = &archive;
+  }
+  double wall = 0.0, cpu = 0.0;
+  if (opts.stats) {
+    STATS.timing = 1;
+    wall = monotonic_seconds();
+    cpu = cpu_seconds();
+  }
+  
+  if (opts.serve) {
+    // -j sets the number of connections handled at once
+    #ifndef _WIN32
+      status = run_serve(opts.serve, opts.workspaces, opts.jobs, opts.max_mem, &out);
+    #endif
+  } else if (opts.batch) {
+    // Every input gets its own root; the directory cache spans all of them
+    status = run_batch(&opts, &out);
+    stats_phase("batch", &wall, &cpu);
+  } else if (strcmp(opts.inputs[0], "-") == 0) {
+    // "-" streams stdin, writing each file as its content arrives
+    if (!opts.quiet) log_message(&progress, "Root folder '", ROOT_FOLDER, "' created.");
+    status = process_stream(&out);
+    stats_phase("stream", &wall, &cpu);
+  } else if (opts.watch) {
+    if (!opts.quiet) log_message(&progress, "Root folder '", ROOT_FOLDER, "' created.");
+    status = process_watch(opts.inputs[0], &out);
+    stats_phase("watch", &wall, &cpu);
+  } else {
+    struct input_buffer input = {0};
+    struct writer_pool pool;
+    struct writer_pool *writers = NULL;
+    
+    input.limit = opts.max_mem;
+    input.stream = !opts.manifest && !out.tar && !out.incremental;
+    int loaded = load_input(opts.inputs[0], opts.use_mmap, &input);
+    stats_phase("load", &wall, &cpu);
+    if (loaded != 0) {
+      perror("Error opening input file");
+      status = 1;
+    } else if (input.rest && opts.manifest) {
+      fprintf(stderr, "%s: %s is larger than --max-mem, which --dry-run cannot stream\n",
+          PROGRAM_NAME, opts.inputs[0]);
+      status = 1;
+    } else if (input.rest) {
+      status = process_rest(opts.inputs[0], &input, &out);
+      stats_phase("stream", &wall, &cpu);
+    } else if (opts.manifest) {
+      status = write_manifest(&input, opts.inputs[0], (enum manifest_format)opts.manifest,
+          out.filter);
+      stats_phase("parse", &wall, &cpu);
+    } else {
+      if (opts.jobs > 1 && !out.tar) {
+        if (writer_pool_start(&pool, opts.jobs, &dirs) == 0) {
+          writers = &pool;
+        } else {
+          fprintf(stderr, "%s: could not start writer threads, writing sequentially\n", PROGRAM_NAME);
+        }
+      }
+      // The ring and the batch only replace inline writes; --incremental reads files first
+      #ifdef AI2FS_URING
+        if (!writers && opts.use_uring && !opts.incremental && !out.tar) {
+          out.ring = uring_start();
+        }
+      #endif
+      #ifdef AI2FS_OVERLAPPED
+        if (!writers && opts.use_uring && !opts.incremental && !out.tar) {
+          out.batch = overlapped_start();
+        }
+      #endif
+      if (opts.parse_jobs > 1) {
+        process_input_parallel(&input, &out, writers, opts.parse_jobs);
+      } else {
+        process_input(&input, &out, writers);
+      }
+      #ifdef AI2FS_URING
+        uring_finish(out.ring);
+        out.ring = NULL;
+      #endif
+      #ifdef AI2FS_OVERLAPPED
+        overlapped_finish(out.batch);
+        out.batch = NULL;
+      #endif
+      stats_phase("parse", &wall, &cpu);
+      if (writers) {
+        writer_pool_finish(writers);
+        stats_phase("drain", &wall, &cpu);
+      }
+    }
+    release_input(&input);
+  }
+  
+  if (out.tar) {
+    if (tar_close(&archive) != 0) {
+      status = 1;
+    } else if (!opts.quiet) {
+      log_message(&progress, "Archive '", opts.archive, "' written.");
+    }
+  }
+  log_destroy(&progress);
+  if (opts.incremental && !opts.serve) {
+    printf("Files: %lu created, %lu updated, %lu unchanged\n", (unsigned long)totals.created,
+        (unsigned long)totals.updated, (unsigned long)totals.unchanged);
+  }
+  if (opts.stats) {
+    fflush(stdout);
+    print_stats((enum stats_format)opts.stats, &totals);
+  }
+  
+  mutex_destroy(&totals.lock);
+  free_dir_cache(&dirs);
+  path_filter_free(&filter);
+  free_options(&opts);
+  ai2fs_markers_free(MARKERS);
+  return status;
+}
@@ -0,0 +1,124 @@
+/*
+ * libai2fs - the parser behind ai2fs, for embedding
+ *
+ * Splits AI assistant output into files at path marker lines without
+ * touching the filesystem. Text goes in as one buffer or as chunks of any
+ * size; files come out through callbacks. There is no global state: a
+ * marker set is read-only once created and may be shared between threads,
+ * and each parser belongs to the thread feeding it.
+ *
+ * Example:
+ *   ai2fs_markers *markers = ai2fs_markers_new();
+ *   struct ai2fs_callbacks callbacks = { begin, data, end };
+ *   ai2fs_parse(markers, text, text_len, &callbacks, my_context, NULL);
+ *   ai2fs_markers_free(markers);
+ *
+ * Author: Izac Cavalheiro
+ * License: MIT
+ */
+
+#ifndef AI2FS_H
+#define AI2FS_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Longest path reported, terminator included; longer paths are cut */
+#define AI2FS_MAX_PATH 256
+#define AI2FS_MAX_MARKERS 64
+#define AI2FS_MAX_MARKER_LENGTH 32
+#define AI2FS_NO_MARKER (-1)
+
+/* Where the path sits within a classified line */
+struct ai2fs_span {
+  size_t start;
+  size_t len;
+};
+
+/* Running totals of a parse */
+struct ai2fs_counts {
+  unsigned long long lines;
+  unsigned long long markers[AI2FS_MAX_MARKERS];
+  size_t held_capacity;
+};
+
+/*
+ * Called in order for each file: on_file_begin once with its path (NUL
+ * terminated, valid for the call), on_data zero or more times with the
+ * next piece of its content, then on_file_end. Text before the first path
+ * line belongs to no file and is dropped. Any callback may be NULL. A
+ * non-zero return stops the parse, and the call that was running returns
+ * that value.
+ */
+struct ai2fs_callbacks {
+  int (*on_file_begin)(void *context, const char *path, int marker);
+  int (*on_data)(void *context, const char *data, size_t len);
+  int (*on_file_end)(void *context);
+};
+
+typedef struct ai2fs_markers ai2fs_markers;
+typedef struct ai2fs_parser ai2fs_parser;
+
+/* The built-in marker set; NULL if out of memory */
+ai2fs_markers *ai2fs_markers_new(void);
+
+/*
+ * Compiles a marker set from count texts in priority order: when several
+ * match a line, the first one wins. As with the built-in set, a marker
+ * matches a line that starts with all of it but its last character, and
+ * the path starts after the whole marker, or after all but its last
+ * character if it contains a space. Texts are copied and must be 2 to
+ * AI2FS_MAX_MARKER_LENGTH bytes. Returns NULL with errno set to EINVAL or
+ * ENOMEM.
+ */
+ai2fs_markers *ai2fs_markers_compile(const char *const *texts, size_t count);
+void ai2fs_markers_free(ai2fs_markers *markers);
+size_t ai2fs_marker_count(const ai2fs_markers *markers);
+const char *ai2fs_marker_text(const ai2fs_markers *markers, int marker);
+
+/* Name of the line scanner picked for this CPU ("sse2", "neon" or "scalar") */
+const char *ai2fs_scanner_name(const ai2fs_markers *markers);
+
+/* Non-zero if a line starting with byte c could be a path line */
+int ai2fs_may_start_marker(const ai2fs_markers *markers, unsigned char c);
+
+/*
+ * Classifies one line (with or without its newline). Returns the marker
+ * index and fills in path, or AI2FS_NO_MARKER if the line is content.
+ */
+int ai2fs_classify_line(const ai2fs_markers *markers, const char *line, size_t len,
+    struct ai2fs_span *path);
+
+/*
+ * Parses a complete text. on_data receives one slice of data per file, so
+ * nothing is copied. counts may be NULL.
+ */
+int ai2fs_parse(const ai2fs_markers *markers, const char *data, size_t len,
+    const struct ai2fs_callbacks *callbacks, void *context, struct ai2fs_counts *counts);
+
+/*
+ * Push parser for text that arrives in pieces, split anywhere (e.g. LLM
+ * tokens). Content is passed to on_data as soon as it is fed, as slices of
+ * the caller's buffer. Only a line that might be a path line is copied,
+ * and only until it is decided: when its newline arrives, or earlier once
+ * its start rules out every marker or it shows a tree glyph. Each byte is
+ * copied at most once. ai2fs_parser_feed() returns -1 if that copy cannot
+ * be made.
+ * ai2fs_parser_finish() ends the text, after which the parser can start
+ * over; its counts keep adding up.
+ */
+ai2fs_parser *ai2fs_parser_new(const ai2fs_markers *markers,
+    const struct ai2fs_callbacks *callbacks, void *context);
+int ai2fs_parser_feed(ai2fs_parser *parser, const char *data, size_t len);
+int ai2fs_parser_finish(ai2fs_parser *parser);
+const struct ai2fs_counts *ai2fs_parser_counts(const ai2fs_parser *parser);
+void ai2fs_parser_free(ai2fs_parser *parser);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
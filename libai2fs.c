@@ -0,0 +1,602 @@
+/*
+ * libai2fs - the parser behind ai2fs
+ *
+ * Marker matching, line classification and the push parser, with no I/O
+ * and no mutable globals. The command-line tool in ai2fs.c is built on top
+ * of it; see ai2fs.h for the interface.
+ *
+ * Author: Izac Cavalheiro
+ * License: MIT
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "ai2fs.h"
+
+/* Vector line scanners; build with -DAI2FS_NO_SIMD for the scalar one only */
+#if !defined(AI2FS_NO_SIMD) && (defined(__GNUC__) || defined(__clang__))
+  #if defined(__x86_64__) || defined(__i386__)
+    #define AI2FS_SSE2 1
+    #include <emmintrin.h>
+  #elif defined(__aarch64__) || defined(__ARM_NEON)
+    #define AI2FS_NEON 1
+    #include <arm_neon.h>
+  #endif
+#endif
+
+#define HELD_INITIAL_SIZE 256
+
+/* Built-in markers, in priority order */
+static const char *const PATH_MARKERS[] = {
+  "// ", "#  ", "-->", "->", "=> ", "> ", "[ ", "- ", "***", "---", "## ",
+  NULL
+};
+
+/*
+ * A marker matches when the line starts with its first match_len bytes (the
+ * marker minus its last character) and the path begins skip_len bytes in.
+ */
+struct marker_rule {
+  size_t match_len;
+  size_t skip_len;
+};
+
+/* What the classifier needs to know about a candidate line beyond its marker */
+struct line_scan {
+  size_t last_dot;
+  int has_dot;
+  int is_tree;
+};
+
+typedef void (*line_scanner)(const unsigned char *s, size_t len, struct line_scan *scan);
+
+/*
+ * A compiled marker set. The match prefixes of all markers form one DFA:
+ * next[state][byte] is the following state, 0 meaning no marker can match
+ * any more, and accept[state] is the first marker (in priority order) whose
+ * prefix ends there. Finding a line's marker therefore costs one table
+ * lookup per byte of the longest prefix, however many markers there are.
+ * The line scanner is picked for the CPU once, when the set is compiled.
+ */
+struct ai2fs_markers {
+  const char *texts[AI2FS_MAX_MARKERS];
+  size_t count;
+  struct marker_rule rules[AI2FS_MAX_MARKERS];
+  unsigned short (*next)[256];
+  int *accept;
+  char *text_block;
+  line_scanner scan_line;
+};
+
+/*
+ * Push parser state. held keeps a line that may be a path line until it is
+ * decided, and held_scanned is how much of it has been checked for tree
+ * glyphs; in_content_line is set while the rest of a content line is still
+ * to come. A non-zero callback result sticks in status.
+ */
+struct ai2fs_parser {
+  const ai2fs_markers *markers;
+  struct ai2fs_callbacks callbacks;
+  void *context;
+  struct ai2fs_counts counts;
+  char *held;
+  size_t held_length;
+  size_t held_scanned;
+  int in_file;
+  int in_content_line;
+  int status;
+};
+
+/* Function implementations */
+/* Checks for a tree glyph (├ └ │) or "|--" starting at s[i] */
+static int tree_marker_at(const unsigned char *s, size_t len, size_t i) {
+  if (i + 2 >= len) return 0;
+  if (s[i] == 0xE2) {
+    return s[i + 1] == 0x94 && (s[i + 2] == 0x9C || s[i + 2] == 0x94 || s[i + 2] == 0x82);
+  }
+  return s[i] == '|' && s[i + 1] == '-' && s[i + 2] == '-';
+}
+
+static void scan_line_scalar(const unsigned char *s, size_t len, struct line_scan *scan) {
+  size_t i;
+  
+  for (i = 0; i < len; i++) {
+    if (s[i] == '.') {
+      scan->last_dot = i;
+      scan->has_dot = 1;
+    } else if ((s[i] == 0xE2 || s[i] == '|') && tree_marker_at(s, len, i)) {
+      scan->is_tree = 1;
+      return;
+    }
+  }
+}
+
+/*
+ * The vector scanners compare 16 bytes at a time against '.', 0xE2
+ * (lead byte of the box-drawing glyphs) and '|', so a typical comment line
+ * needs a couple of compares instead of one branch per byte. Hits on the
+ * glyph lead bytes are confirmed with tree_marker_at(); the tail shorter
+ * than a vector is handed to the scalar loop.
+ */
+#ifdef AI2FS_SSE2
+__attribute__((target("sse2")))
+static void scan_line_sse2(const unsigned char *s, size_t len, struct line_scan *scan) {
+  const __m128i dot = _mm_set1_epi8('.');
+  const __m128i lead = _mm_set1_epi8((char)0xE2);
+  const __m128i pipe = _mm_set1_epi8('|');
+  size_t i;
+  
+  for (i = 0; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    unsigned dots = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, dot));
+    unsigned special = (unsigned)_mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, lead), _mm_cmpeq_epi8(v, pipe)));
+    
+    while (special) {
+      if (tree_marker_at(s, len, i + (size_t)__builtin_ctz(special))) {
+        scan->is_tree = 1;
+        return;
+      }
+      special &= special - 1;
+    }
+    if (dots) {
+      scan->last_dot = i + 31 - (size_t)__builtin_clz(dots);
+      scan->has_dot = 1;
+    }
+  }
+  
+  struct line_scan tail = {0, 0, 0};
+  scan_line_scalar(s + i, len - i, &tail);
+  scan->is_tree = tail.is_tree;
+  if (tail.has_dot) {
+    scan->last_dot = i + tail.last_dot;
+    scan->has_dot = 1;
+  }
+}
+#endif
+
+#ifdef AI2FS_NEON
+/* NEON has no movemask: narrow each byte compare to a nibble of a 64-bit mask */
+static uint64_t neon_mask(uint8x16_t eq) {
+  return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+
+static void scan_line_neon(const unsigned char *s, size_t len, struct line_scan *scan) {
+  const uint8x16_t dot = vdupq_n_u8('.');
+  const uint8x16_t lead = vdupq_n_u8(0xE2);
+  const uint8x16_t pipe = vdupq_n_u8('|');
+  size_t i;
+  
+  for (i = 0; i + 16 <= len; i += 16) {
+    uint8x16_t v = vld1q_u8(s + i);
+    uint64_t dots = neon_mask(vceqq_u8(v, dot));
+    uint64_t special = neon_mask(vorrq_u8(vceqq_u8(v, lead), vceqq_u8(v, pipe)));
+    
+    while (special) {
+      if (tree_marker_at(s, len, i + (size_t)__builtin_ctzll(special) / 4)) {
+        scan->is_tree = 1;
+        return;
+      }
+      special &= ~((uint64_t)0xF << (__builtin_ctzll(special) & ~3));
+    }
+    if (dots) {
+      scan->last_dot = i + (63 - (size_t)__builtin_clzll(dots)) / 4;
+      scan->has_dot = 1;
+    }
+  }
+  
+  struct line_scan tail = {0, 0, 0};
+  scan_line_scalar(s + i, len - i, &tail);
+  scan->is_tree = tail.is_tree;
+  if (tail.has_dot) {
+    scan->last_dot = i + tail.last_dot;
+    scan->has_dot = 1;
+  }
+}
+#endif
+
+const char *ai2fs_scanner_name(const ai2fs_markers *markers) {
+  #ifdef AI2FS_SSE2
+    if (markers->scan_line == scan_line_sse2) return "sse2";
+  #endif
+  #ifdef AI2FS_NEON
+    if (markers->scan_line == scan_line_neon) return "neon";
+  #endif
+  (void)markers;
+  return "scalar";
+}
+
+ai2fs_markers *ai2fs_markers_compile(const char *const *texts, size_t count) {
+  size_t text_size = 0;
+  size_t states = 1;
+  size_t i, j;
+  
+  if (!texts || count == 0 || count > AI2FS_MAX_MARKERS) {
+    errno = EINVAL;
+    return NULL;
+  }
+  for (i = 0; i < count; i++) {
+    size_t len = texts[i] ? strlen(texts[i]) : 0;
+    if (len < 2 || len > AI2FS_MAX_MARKER_LENGTH) {
+      errno = EINVAL;
+      return NULL;
+    }
+    text_size += len + 1;
+    states += len - 1;
+  }
+  
+  ai2fs_markers *markers = calloc(1, sizeof(*markers));
+  if (!markers) return NULL;
+  markers->text_block = malloc(text_size);
+  markers->next = calloc(states, sizeof(*markers->next));
+  markers->accept = malloc(states * sizeof(*markers->accept));
+  if (!markers->text_block || !markers->next || !markers->accept) {
+    ai2fs_markers_free(markers);
+    errno = ENOMEM;
+    return NULL;
+  }
+  for (i = 0; i < states; i++) {
+    markers->accept[i] = AI2FS_NO_MARKER;
+  }
+  
+  // Add each match prefix to the DFA; a state keeps the first marker ending in it
+  char *copy = markers->text_block;
+  unsigned short used = 1;
+  for (i = 0; i < count; i++) {
+    size_t len = strlen(texts[i]);
+    struct marker_rule *rule = &markers->rules[i];
+    unsigned short state = 0;
+    
+    memcpy(copy, texts[i], len + 1);
+    markers->texts[i] = copy;
+    copy += len + 1;
+    rule->match_len = len - 1;
+    rule->skip_len = strchr(texts[i], ' ') ? len - 1 : len;
+    
+    for (j = 0; j < rule->match_len; j++) {
+      unsigned char c = (unsigned char)texts[i][j];
+      if (markers->next[state][c] == 0) markers->next[state][c] = used++;
+      state = markers->next[state][c];
+    }
+    if (markers->accept[state] == AI2FS_NO_MARKER) markers->accept[state] = (int)i;
+  }
+  markers->count = count;
+  
+  // Use the vector scanner when the CPU has it (always on x86-64 and AArch64)
+  markers->scan_line = scan_line_scalar;
+  #if defined(AI2FS_SSE2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+      markers->scan_line = scan_line_sse2;
+    }
+  #elif defined(AI2FS_NEON)
+    markers->scan_line = scan_line_neon;
+  #endif
+  return markers;
+}
+
+ai2fs_markers *ai2fs_markers_new(void) {
+  return ai2fs_markers_compile(PATH_MARKERS, sizeof(PATH_MARKERS) / sizeof(PATH_MARKERS[0]) - 1);
+}
+
+void ai2fs_markers_free(ai2fs_markers *markers) {
+  if (!markers) return;
+  free(markers->text_block);
+  free(markers->next);
+  free(markers->accept);
+  free(markers);
+}
+
+size_t ai2fs_marker_count(const ai2fs_markers *markers) {
+  return markers->count;
+}
+
+const char *ai2fs_marker_text(const ai2fs_markers *markers, int marker) {
+  if (marker < 0 || (size_t)marker >= markers->count) return NULL;
+  return markers->texts[marker];
+}
+
+int ai2fs_may_start_marker(const ai2fs_markers *markers, unsigned char c) {
+  return markers->next[0][c] != 0;
+}
+
+/*
+ * Runs the marker DFA over the start of a line. Returns the first marker in
+ * priority order whose match prefix starts the line, or AI2FS_NO_MARKER.
+ * live is cleared when the DFA dies, i.e. no longer line could match more.
+ */
+static int match_marker(const ai2fs_markers *markers, const unsigned char *s, size_t len,
+    int *live) {
+  unsigned short state = 0;
+  int best = AI2FS_NO_MARKER;
+  size_t i;
+  
+  for (i = 0; i < len; i++) {
+    state = markers->next[state][s[i]];
+    if (state == 0) {
+      *live = 0;
+      return best;
+    }
+    int accept = markers->accept[state];
+    if (accept != AI2FS_NO_MARKER && (best == AI2FS_NO_MARKER || accept < best)) best = accept;
+  }
+  *live = 1;
+  return best;
+}
+
+/*
+ * Classifies a line in a single pass. A path line starts with a marker at
+ * column 0, is not part of a directory tree preview, and names a file with
+ * an extension.
+ */
+int ai2fs_classify_line(const ai2fs_markers *markers, const char *line, size_t len,
+    struct ai2fs_span *path) {
+  const unsigned char *s = (const unsigned char *)line;
+  
+  // Most lines are content: reject them on the first byte
+  if (len == 0 || markers->next[0][s[0]] == 0) return AI2FS_NO_MARKER;
+  
+  // Drop trailing whitespace, then one vector pass for tree glyphs and the last dot
+  size_t end = len;
+  while (end > 0 && isspace(s[end - 1])) {
+    end--;
+  }
+  
+  struct line_scan scan = {0, 0, 0};
+  markers->scan_line(s, end, &scan);
+  if (scan.is_tree) return AI2FS_NO_MARKER;
+  
+  // Find the first marker, in priority order, that prefixes the line
+  int live;
+  int marker = match_marker(markers, s, end, &live);
+  if (marker == AI2FS_NO_MARKER) return AI2FS_NO_MARKER;
+  
+  // Skip the marker and any spaces after it; something must follow
+  size_t start = markers->rules[marker].skip_len;
+  while (start < end && isspace(s[start])) {
+    start++;
+  }
+  if (start >= end) return AI2FS_NO_MARKER;
+  
+  // Must have a file extension
+  if (!scan.has_dot || scan.last_dot < start || scan.last_dot + 1 >= end) return AI2FS_NO_MARKER;
+  
+  // Paths are capped before trimming, then lose one closing bracket
+  if (end - start > AI2FS_MAX_PATH - 1) {
+    end = start + AI2FS_MAX_PATH - 1;
+    while (end > start && isspace(s[end - 1])) {
+      end--;
+    }
+  }
+  if (end > start && s[end - 1] == ']') {
+    end--;
+    while (end > start && isspace(s[end - 1])) {
+      end--;
+    }
+  }
+  
+  if (path) {
+    path->start = start;
+    path->len = end - start;
+  }
+  return marker;
+}
+
+/*
+ * Non-zero if an unfinished line is already known to be content: its start
+ * can no longer become any marker, or it contains a tree glyph. Both stay
+ * true however the line goes on, so its bytes can be released before the
+ * newline arrives. Glyphs are looked for from byte from on, which lets a
+ * held line be checked as it grows without rescanning it.
+ */
+static int partial_is_content(const ai2fs_markers *markers, const char *line, size_t len,
+    size_t from) {
+  const unsigned char *s = (const unsigned char *)line;
+  int live;
+  size_t i;
+  
+  if (match_marker(markers, s, len, &live) == AI2FS_NO_MARKER && !live) return 1;
+  
+  // A glyph split across chunks is found once all three bytes are here
+  for (i = from > 2 ? from - 2 : 0; i < len; i++) {
+    if ((s[i] == 0xE2 || s[i] == '|') && tree_marker_at(s, len, i)) return 1;
+  }
+  return 0;
+}
+
+/* Passes content to the current file; text before the first path line is dropped */
+static int parser_data(ai2fs_parser *parser, const char *data, size_t len) {
+  if (!parser->in_file || len == 0 || !parser->callbacks.on_data) return 0;
+  return parser->callbacks.on_data(parser->context, data, len);
+}
+
+static int parser_end_file(ai2fs_parser *parser) {
+  if (!parser->in_file) return 0;
+  parser->in_file = 0;
+  if (!parser->callbacks.on_file_end) return 0;
+  return parser->callbacks.on_file_end(parser->context);
+}
+
+/* Ends the current file and starts the one named by a path line */
+static int parser_begin_file(ai2fs_parser *parser, const char *line,
+    const struct ai2fs_span *span, int marker) {
+  char path[AI2FS_MAX_PATH];
+  int status = parser_end_file(parser);
+  
+  parser->counts.markers[marker]++;
+  if (status != 0) return status;
+  memcpy(path, line + span->start, span->len);
+  path[span->len] = '\0';
+  parser->in_file = 1;
+  if (!parser->callbacks.on_file_begin) return 0;
+  return parser->callbacks.on_file_begin(parser->context, path, marker);
+}
+
+/* Classifies a complete line; content goes to the current file */
+static int parser_line(ai2fs_parser *parser, const char *line, size_t len) {
+  struct ai2fs_span span;
+  int marker = ai2fs_classify_line(parser->markers, line, len, &span);
+  
+  parser->counts.lines++;
+  if (marker == AI2FS_NO_MARKER) return parser_data(parser, line, len);
+  return parser_begin_file(parser, line, &span, marker);
+}
+
+static int parser_hold(ai2fs_parser *parser, const char *data, size_t len) {
+  size_t needed = parser->held_length + len;
+  
+  if (needed > parser->counts.held_capacity) {
+    size_t capacity = parser->counts.held_capacity ? parser->counts.held_capacity : HELD_INITIAL_SIZE;
+    while (capacity < needed) {
+      capacity *= 2;
+    }
+    char *grown = realloc(parser->held, capacity);
+    if (!grown) return -1;
+    parser->held = grown;
+    parser->counts.held_capacity = capacity;
+  }
+  memcpy(parser->held + parser->held_length, data, len);
+  parser->held_length = needed;
+  return 0;
+}
+
+/*
+ * Runs the parser over data. Content lines pass through as slices of data,
+ * merged until the next path line; a line that may be a path line is
+ * classified once its newline is here. An unfinished one is passed through
+ * too if it is already known to be content, and held otherwise. With
+ * at_eof there is nothing more to come and nothing is held.
+ */
+static int parser_run(ai2fs_parser *parser, const char *data, size_t len, int at_eof) {
+  const char *p = data;
+  const char *end = data + len;
+  const char *run_start = data;
+  int status = 0;
+  
+  while (p < end) {
+    const char *newline = memchr(p, '\n', end - p);
+    const char *next = newline ? newline + 1 : end;
+    
+    // Content lines (and the rest of one already started) need no lookahead
+    if (parser->in_content_line || !ai2fs_may_start_marker(parser->markers, (unsigned char)*p)) {
+      parser->in_content_line = (newline == NULL);
+      if (newline || at_eof) parser->counts.lines++;
+      p = next;
+      continue;
+    }
+    
+    // A possible marker is classified once its whole line is here
+    if (!newline && !at_eof) {
+      if (!partial_is_content(parser->markers, p, end - p, 0)) break;
+      parser->in_content_line = 1;
+      p = end;
+      break;
+    }
+    parser->counts.lines++;
+    
+    struct ai2fs_span span;
+    int marker = ai2fs_classify_line(parser->markers, p, next - p, &span);
+    if (marker != AI2FS_NO_MARKER) {
+      status = parser_data(parser, run_start, p - run_start);
+      if (status == 0) status = parser_begin_file(parser, p, &span, marker);
+      if (status != 0) return status;
+      run_start = next;
+    }
+    p = next;
+  }
+  
+  status = parser_data(parser, run_start, p - run_start);
+  if (status == 0 && p < end) {
+    status = parser_hold(parser, p, end - p);
+    parser->held_scanned = parser->held_length;
+  }
+  return status;
+}
+
+int ai2fs_parse(const ai2fs_markers *markers, const char *data, size_t len,
+    const struct ai2fs_callbacks *callbacks, void *context, struct ai2fs_counts *counts) {
+  ai2fs_parser parser;
+  
+  memset(&parser, 0, sizeof(parser));
+  parser.markers = markers;
+  parser.callbacks = *callbacks;
+  parser.context = context;
+  
+  int status = parser_run(&parser, data, len, 1);
+  if (status == 0) status = parser_end_file(&parser);
+  if (counts) *counts = parser.counts;
+  return status;
+}
+
+ai2fs_parser *ai2fs_parser_new(const ai2fs_markers *markers,
+    const struct ai2fs_callbacks *callbacks, void *context) {
+  ai2fs_parser *parser = calloc(1, sizeof(*parser));
+  
+  if (!parser) return NULL;
+  parser->markers = markers;
+  parser->callbacks = *callbacks;
+  parser->context = context;
+  return parser;
+}
+
+int ai2fs_parser_feed(ai2fs_parser *parser, const char *data, size_t len) {
+  if (parser->status != 0) return parser->status;
+  
+  // Settle a held line first; only the bytes up to its newline are copied
+  if (parser->held_length > 0 && len > 0) {
+    const char *newline = memchr(data, '\n', len);
+    size_t take = newline ? (size_t)(newline + 1 - data) : len;
+    
+    parser->status = parser_hold(parser, data, take);
+    if (parser->status != 0) return parser->status;
+    if (newline) {
+      parser->status = parser_line(parser, parser->held, parser->held_length);
+    } else if (partial_is_content(parser->markers, parser->held, parser->held_length,
+        parser->held_scanned)) {
+      // Release it now; the rest of the line passes straight through
+      parser->status = parser_data(parser, parser->held, parser->held_length);
+      parser->in_content_line = 1;
+    } else {
+      parser->held_scanned = parser->held_length;
+      return 0;
+    }
+    parser->held_length = 0;
+    if (parser->status != 0) return parser->status;
+    data += take;
+    len -= take;
+  }
+  
+  parser->status = parser_run(parser, data, len, 0);
+  return parser->status;
+}
+
+int ai2fs_parser_finish(ai2fs_parser *parser) {
+  int status = parser->status;
+  
+  // Whatever is still open ends here, without a newline
+  if (status == 0 && parser->held_length > 0) {
+    status = parser_line(parser, parser->held, parser->held_length);
+  } else if (parser->in_content_line) {
+    parser->counts.lines++;
+  }
+  if (status == 0) status = parser_end_file(parser);
+  
+  parser->held_length = 0;
+  parser->in_file = 0;
+  parser->in_content_line = 0;
+  parser->status = 0;
+  return status;
+}
+
+const struct ai2fs_counts *ai2fs_parser_counts(const ai2fs_parser *parser) {
+  return &parser->counts;
+}
+
+void ai2fs_parser_free(ai2fs_parser *parser) {
+  if (!parser) return;
+  free(parser->held);
+  free(parser);
+}